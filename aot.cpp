@@ -0,0 +1,419 @@
+#include "simpleton4asm.h"
+
+// Static recompiler: assembles source and writes C++ program running it with guest routines
+// translated to C++ functions. Registers are locals, branches are if/goto and memory, ports
+// and events go through Machine (see simpleton4native.h), so result is exactly as interpreted.
+// Computed jumps into code never seen and overwritten code fall back to interpreter.
+// usage: aot source.asm out.cpp
+// then:  g++ -O2 out.cpp simpleton4.cpp simpleton4dev.cpp -o out.exe
+
+using namespace Simpleton;
+
+struct Op
+{
+	mWord		addr;
+	Instruction	in;
+	int		len;		// words with immediates, 0 - not compiled (halt, I/O page)
+	bool		jump;		// writes PC register
+	bool		call;		// jump after push of its return address, first target is routine
+	std::vector< mWord >	targets;	// values written to PC known before run
+};
+
+struct Routine
+{
+	mWord			entry;
+	std::map< mWord, Op >	ops;
+};
+
+class Compiler
+{
+private:
+	const std::vector< mWord >	&image;
+	std::map< mWord, std::string >	names;
+	std::vector< Routine >		routines;
+	std::map< mWord, int >		routineAt;	// index by entry
+
+	static std::string hex( int value );
+	bool knownOperand( mTag o, bool i, int &p, mWord &value );
+	void decode( mWord addr, Op &op );
+	int addRoutine( mWord entry );
+	void discover( int index );
+	std::string operand( mTag o, bool i, int &p, bool &mayStop );
+	void writeOp( std::ostream &out, const Op &op );
+	void writeRoutine( std::ostream &out, const Routine &r );
+
+public:
+	Compiler( const std::vector< mWord > &_image, const std::vector< Symbol > &symbols ): image( _image )
+	{
+		for ( auto &s : symbols )
+			names[ s.addr ] = s.name;
+	}
+	void compile();
+	void write( std::ostream &out, const std::string &source );
+};
+
+std::string Compiler::hex( int value )
+{
+	std::stringstream ss;
+	ss << "0x" << std::uppercase << std::hex << std::setw( 4 ) << std::setfill( '0' ) << (value & 0xFFFF);
+	return ss.str();
+}
+
+// value of operand if it does not depend on run, p is PC while operand is read
+bool Compiler::knownOperand( mTag o, bool i, int &p, mWord &value )
+{
+	if ( i && (o == REG_PC) )
+	{
+		value = (p < PORT_START) ? image[ p ] : 0;
+		p++;
+		return true;
+	}
+	if ( i && (o == REG_PSW) )
+		p++;
+	if ( !i && (o == REG_PC) )
+	{
+		value = p;
+		return true;
+	}
+	return false;
+}
+
+void Compiler::decode( mWord addr, Op &op )
+{
+	op.addr = addr;
+	op.len = 0;
+	op.jump = false;
+	op.call = false;
+	op.targets.clear();
+	if ( (addr >= PORT_START) || (image[ addr ] == 0) )
+		return;
+	op.in.decode( image[ addr ] );
+	const Instruction &in = op.in;
+
+	int p = addr + 1;
+	bool xKnown, yKnown;
+	mWord x = 0, y = 0;
+	if ( Instruction::isInplaceImmediate( in.cmd ) )
+	{
+		xKnown = true;
+		x = in.xi ? (0xFFF8 | in.x) : in.x;
+	}
+	else
+		xKnown = knownOperand( in.x, in.xi, p, x );
+	yKnown = knownOperand( in.y, in.yi, p, y );
+	if ( in.ri && (in.r == REG_PSW) )
+		p++;
+	if ( p > PORT_START )
+		return;	// immediates in I/O page
+	op.len = p - addr;
+
+	if ( in.ri || (in.r != REG_PC) )
+		return;
+	op.jump = true;
+	if ( !xKnown || !yKnown )
+		return;	// computed jump
+	switch ( in.cmd )
+	{
+	case OP_ADDIS:
+	case OP_ADDS:
+	case OP_ADD:
+	case OP_ADDI:	op.targets.push_back( y + x ); break;
+	case OP_SUB:	op.targets.push_back( y - x ); break;
+	case OP_AND:	op.targets.push_back( y & x ); break;
+	case OP_OR:	op.targets.push_back( y | x ); break;
+	case OP_XOR:	op.targets.push_back( y ^ x ); break;
+	case OP_CADD:
+		{
+			mWord cond = (x >> 13) & 0b111;
+			mWord offs = x & 0b1111111111111;
+			if ( offs & 0b1000000000000 )
+				offs = offs | 0b1110000000000000;
+			if ( (cond <= COND_NSIGN) && (offs != 0) )
+				op.targets.push_back( y + offs );
+			op.targets.push_back( y );	// condition is false
+		}
+		break;
+	};
+	// 'call' is push of address after jump and jump itself
+	op.call =	(op.targets.size() == 1) && (in.cmd != OP_CADD) && (op.len == 2) && (addr > 0) &&
+			(image[ addr - 1 ] == Instruction::encode( OP_ADDIS, IND_SP, REG_PC, 2 )) &&
+			(op.targets[ 0 ] < PORT_START);
+}
+
+int Compiler::addRoutine( mWord entry )
+{
+	auto it = routineAt.find( entry );
+	if ( it != routineAt.end() )
+		return it->second;
+	routineAt[ entry ] = routines.size();
+	routines.emplace_back();
+	routines.back().entry = entry;
+	return routines.size() - 1;
+}
+
+// every instruction reachable from entry without following calls
+void Compiler::discover( int index )
+{
+	std::vector< mWord > work{ routines[ index ].entry };
+	while ( !work.empty() )
+	{
+		mWord addr = work.back();
+		work.pop_back();
+		if ( routines[ index ].ops.count( addr ) )
+			continue;
+		Op op;
+		decode( addr, op );
+		routines[ index ].ops[ addr ] = op;
+		if ( op.len == 0 )
+			continue;
+		if ( op.call )
+		{
+			addRoutine( op.targets[ 0 ] );	// routines may grow
+			work.push_back( addr + op.len );
+		}
+		else if ( op.jump )
+		{
+			for ( mWord t : op.targets )
+				work.push_back( t );
+		}
+		else
+			work.push_back( addr + op.len );
+	}
+}
+
+void Compiler::compile()
+{
+	addRoutine( 0 );	// reset PC
+	for ( size_t i = 0; i < routines.size(); i++ )
+		discover( i );
+}
+
+// code reading operand, p is PC while operand is read
+std::string Compiler::operand( mTag o, bool i, int &p, bool &mayStop )
+{
+	if ( i && (o == REG_PC) )
+		return "Native::immediate( m, " + hex( image[ p++ ] ) + " )";
+	if ( i && (o == REG_PSW) )
+	{
+		mWord addr = image[ p++ ];
+		mayStop |= (addr >= PORT_START);
+		return "Native::read( m, Native::immediate( m, " + hex( addr ) + " ) )";
+	}
+	if ( i )
+	{
+		mayStop = true;	// address may be port
+		if ( o == REG_SP )
+			return "Native::read( m, reg[ REG_SP ]++ )";
+		return "Native::read( m, reg[ " + std::to_string( o ) + " ] )";
+	}
+	if ( o == REG_PC )
+		return hex( p );
+	return "reg[ " + std::to_string( o ) + " ]";
+}
+
+void Compiler::writeOp( std::ostream &out, const Op &op )
+{
+	const Instruction &in = op.in;
+	out << "L_" << hex( op.addr ).substr( 2 ) << ":";
+	if ( names.count( op.addr ) )
+		out << "\t// " << names[ op.addr ];
+	out << "\n";
+	if ( op.len == 0 )
+	{
+		out << "\tpc = " << hex( op.addr ) << ";\n";
+		out << "\tgoto leave;\n";
+		return;
+	}
+
+	int p = op.addr + 1;
+	bool mayStop = false;
+	out << "\tNative::tick( m, c.opcode );\n";
+	if ( Instruction::isInplaceImmediate( in.cmd ) )
+		out << "\tx = " << hex( in.xi ? (0xFFF8 | in.x) : in.x ) << ";\n";
+	else
+		out << "\tx = " << operand( in.x, in.xi, p, mayStop ) << ";\n";
+	out << "\ty = " << operand( in.y, in.yi, p, mayStop ) << ";\n";
+
+	switch ( in.cmd )
+	{
+	case OP_ADDIS:
+	case OP_ADDS:	out << "\ta = y + x;\n"; break;
+	case OP_ADD:
+	case OP_ADDI:	out << "\tNative::apply( reg[ REG_PSW ], a, y + x );\n"; break;
+	case OP_ADC:	out << "\tNative::apply( reg[ REG_PSW ], a, y + x + Native::carry( reg[ REG_PSW ] ) );\n"; break;
+	case OP_SUB:	out << "\tNative::apply( reg[ REG_PSW ], a, y - x );\n"; break;
+	case OP_SBC:	out << "\tNative::apply( reg[ REG_PSW ], a, y - x - Native::carry( reg[ REG_PSW ] ) );\n"; break;
+	case OP_AND:	out << "\tNative::apply( reg[ REG_PSW ], a, x & y );\n"; break;
+	case OP_OR:	out << "\tNative::apply( reg[ REG_PSW ], a, x | y );\n"; break;
+	case OP_XOR:	out << "\tNative::apply( reg[ REG_PSW ], a, x ^ y );\n"; break;
+	case OP_CADD:	out << "\ta = Native::cadd( reg[ REG_PSW ], x, y );\n"; break;
+	default:	break;	// result of previous instruction is stored
+	};
+
+	if ( in.ri && (in.r != REG_PC) )
+	{
+		mayStop = true;	// written words may be compiled code
+		if ( in.r == REG_SP )
+			out << "\tNative::write( m, --reg[ REG_SP ], a );\n";
+		else if ( in.r == REG_PSW )
+			out << "\tNative::write( m, Native::immediate( m, " << hex( image[ p++ ] ) << " ), a );\n";
+		else
+			out << "\tNative::write( m, reg[ " << int( in.r ) << " ], a );\n";
+	}
+	else if ( !in.ri && (in.r != REG_PC) )
+		out << "\treg[ " << int( in.r ) << " ] = a;\n";
+
+	out << "\tpc = " << (op.jump ? std::string( "a" ) : hex( op.addr + op.len )) << ";\n";
+	out << "\tif ( Native::retire( m ) )\n\t\tgoto events;\n";
+	if ( mayStop )
+		out << "\tif ( Native::stopped( m ) )\n\t\tgoto leave;\n";
+
+	if ( op.call )
+	{
+		// guest call is native call while guest returns right after it
+		mWord ret = op.addr + op.len;
+		out << "\tif ( !valid[ " << routineAt[ op.targets[ 0 ] ] << " ] || (depth >= MAX_CALL_DEPTH) )\n\t\tgoto leave;\n";
+		out << "\tNative::leave( m, reg, pc, a );\n";
+		out << "\tdepth++;\n";
+		out << "\tr_" << hex( op.targets[ 0 ] ).substr( 2 ) << "( m );\n";
+		out << "\tdepth--;\n";
+		out << "\tif ( Native::stopped( m ) )\n\t\treturn;\n";
+		out << "\tNative::enter( m, reg, a );\n";
+		out << "\tpc = reg[ REG_PC ];\n";
+		out << "\tif ( pc == " << hex( ret ) << " )\n\t\tgoto L_" << hex( ret ).substr( 2 ) << ";\n";
+		out << "\tgoto dispatch;\n";
+	}
+	else if ( op.jump )
+	{
+		for ( mWord t : op.targets )
+			out << "\tif ( pc == " << hex( t ) << " )\n\t\tgoto L_" << hex( t ).substr( 2 ) << ";\n";
+		out << "\tgoto dispatch;\n";
+	}
+	else
+		out << "\tgoto L_" << hex( op.addr + op.len ).substr( 2 ) << ";\n";
+}
+
+void Compiler::writeRoutine( std::ostream &out, const Routine &r )
+{
+	std::string name = "r_" + hex( r.entry ).substr( 2 );
+	out << "\n";
+	if ( names.count( r.entry ) )
+		out << "// " << names[ r.entry ] << "\n";
+	out << "static void " << name << "( Machine &m )\n{\n";
+	out << "\tconst CostModel &c = Native::cost( m );\n";
+	out << "\tmWord reg[ 8 ], a, x, y, pc;\n";
+	out << "\tNative::enter( m, reg, a );\n";
+	out << "\tpc = reg[ REG_PC ];\n";
+	out << "dispatch:\n";
+	out << "\tswitch ( pc )\n\t{\n";
+	for ( auto &o : r.ops )
+		out << "\tcase " << hex( o.first ) << ":\tgoto L_" << hex( o.first ).substr( 2 ) << ";\n";
+	out << "\t};\n";
+	out << "\tgoto leave;\n";
+	for ( auto &o : r.ops )
+		writeOp( out, o.second );
+	out << "leave:\n";
+	out << "\tNative::leave( m, reg, pc, a );\n";
+	out << "\treturn;\n";
+	out << "events:\n";
+	out << "\tNative::leave( m, reg, pc, a );\n";
+	out << "\tNative::events( m );\n";
+	out << "}\n";
+}
+
+void Compiler::write( std::ostream &out, const std::string &source )
+{
+	int size = PORT_START;
+	while ( (size > 0) && (image[ size - 1 ] == 0) )
+		size--;
+
+	out << "// Generated by aot from '" << source << "', do not edit.\n";
+	out << "#include \"simpleton4native.h\"\n\n";
+	out << "using namespace Simpleton;\n\n";
+	out << "static const int MAX_CALL_DEPTH = 1000;\n";
+	out << "static int depth = 0;\n\n";
+
+	out << "static const mWord image[ " << std::max( size, 1 ) << " ] =\n{";
+	for ( int i = 0; i < std::max( size, 1 ); i++ )
+		out << ((i % 16) ? " " : "\n\t") << hex( image[ i ] ) << ",";
+	out << "\n};\n\n";
+
+	for ( auto &r : routines )
+		out << "static void r_" << hex( r.entry ).substr( 2 ) << "( Machine &m );\n";
+	out << "\nstatic const Native::Routine routines[] =\n{\n";
+	for ( auto &r : routines )
+		out << "\tr_" << hex( r.entry ).substr( 2 ) << ",\n";
+	out << "};\n";
+	out << "static bool valid[ " << routines.size() << " ] =\n{\n";
+	for ( size_t i = 0; i < routines.size(); i++ )
+		out << "\ttrue,\n";
+	out << "};\n";
+	out << "static const Native::CodeWord entries[] =\n{\n";
+	int entryCount = 0;
+	for ( size_t i = 0; i < routines.size(); i++ )
+	{
+		for ( auto &o : routines[ i ].ops )
+		{
+			if ( o.second.len > 0 )
+			{
+				out << "\t{ " << hex( o.first ) << ", " << i << " },\n";
+				entryCount++;
+			}
+		}
+	}
+	out << "};\n";
+	out << "static const Native::CodeWord words[] =\n{\n";
+	int wordCount = 0;
+	for ( size_t i = 0; i < routines.size(); i++ )
+	{
+		for ( auto &o : routines[ i ].ops )
+		{
+			for ( int w = 0; w < o.second.len; w++ )
+			{
+				out << "\t{ " << hex( o.first + w ) << ", " << i << " },\n";
+				wordCount++;
+			}
+		}
+	}
+	out << "};\n";
+
+	for ( auto &r : routines )
+		writeRoutine( out, r );
+
+	out << "\nint main()\n{\n";
+	out << "\tMachine m;\n";
+	out << "\tfor ( int i = 0; i < " << size << "; i++ )\n";
+	out << "\t{\n\t\tif ( image[ i ] != 0 )\n\t\t\tm.getBus()->write( i, image[ i ] );\n\t}\n";
+	out << "\tNative::Program program = { routines, valid, entries, " << entryCount << ", words, " << wordCount << " };\n";
+	out << "\tif ( Native::run( m, program ) != Machine::StopHalt )\n";
+	out << "\t\tstd::cout << \"Stopped at \" << std::uppercase << std::hex << std::setw( 4 ) << std::setfill( '0' ) << m.getStopAddr() << \"\\n\";\n";
+	out << "\tm.show();\n";
+	out << "\tstd::cout << std::dec << \"Instructions: \" << m.getRetired() << \"  Cycles: \" << m.getCycles() << \"\\n\";\n";
+	out << "\treturn 0;\n";
+	out << "}\n";
+}
+
+int main( int argc, char *argv[] )
+{
+	if ( argc < 3 )
+	{
+		std::cout << "usage: aot source.asm out.cpp\n";
+		return 1;
+	}
+	Assembler a;
+	if ( !a.parseFile( argv[ 1 ] ) )
+	{
+		std::cout << a.getErrorMessage() << "\n";
+		return 1;
+	}
+	Compiler compiler( a.getImage(), a.getSymbols( true ) );
+	compiler.compile();
+	std::ofstream out( argv[ 2 ] );
+	if ( out.fail() )
+	{
+		std::cout << "Cannot write '" << argv[ 2 ] << "'\n";
+		return 1;
+	}
+	compiler.write( out, argv[ 1 ] );
+	return 0;
+}
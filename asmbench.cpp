@@ -0,0 +1,139 @@
+#include "simpleton4asm.h"
+#include <chrono>
+#include <cstdio>
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// Assembler throughput benchmark: synthetic sources of growing size are written to files
+// and assembled by Assembler::parseFile(), lines per second and peak memory are reported,
+// largest program is then disassembled to measure Machine::disassemble().
+// usage: asmbench [maxLines]
+
+static const int INCLUDE_DEPTH = 3;
+
+// peak resident memory of process in KB, it only grows so sizes are run in ascending order
+static size_t peakMemory()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	if ( !GetProcessMemoryInfo( GetCurrentProcess(), &pmc, sizeof( pmc ) ) )
+		return 0;
+	return pmc.PeakWorkingSetSize / 1024;
+#else
+	struct rusage usage;
+	getrusage( RUSAGE_SELF, &usage );
+	return usage.ru_maxrss;
+#endif
+}
+
+// one block of both syntaxes with local labels, forward references, strings and ds
+static int writeBlock( std::ofstream &out, int k )
+{
+	int lines = 16;
+	// block is about 40 words, wrap before address space does to keep branches short
+	if ( (k > 0) && (k % 1024 == 0) )
+	{
+		out << "\t\torg $100\n";
+		lines++;
+	}
+	out <<	"\t\tmode classic\n"
+		"blk" << k << "\t\tmove r0 str" << k << "\t; forward reference\n"
+		".loop\t\tmovet r1 [ r0 ]\n"
+		"\t\tjz .done\n"
+		"\t\tmove [ $FFFF ] r1\n"
+		"\t\taddi r0 r0 1\n"
+		"\t\tmove pc .loop\n"
+		".done\t\tmode new\n"
+		"\t\tr2 <- r2 + 1\n"
+		"\t\t[ var" << k << " ] <- r2\n"
+		"\t\tvoid = r2 - r3\n"
+		"\t\tjnz .loop\n"
+		"\t\tret\n"
+		"str" << k << "\t\tdw \"Generated block\" 13 10 0\n"
+		"var" << k << "\t\tds 4 0\n"
+		"\n";
+	return lines;
+}
+
+// main file includes chain of nested files, each holds part of blocks
+static int generate( int lines )
+{
+	int blocks = std::max( 1, lines / 16 );
+	int written = 0;
+	int k = 0;
+	for ( int f = 0; f <= INCLUDE_DEPTH; f++ )
+	{
+		std::ofstream out( "asmbench" + std::to_string( f ) + ".asm" );
+		if ( f == 0 )
+		{
+			out << "PORT_CONSOLE\t= $FFFF\n\t\tmode new\n\t\tsp <- $70\n";
+			written += 3;
+		}
+		int last = (f == INCLUDE_DEPTH) ? blocks : blocks * (f + 1) / (INCLUDE_DEPTH + 1);
+		for ( ; k < last; k++ )
+			written += writeBlock( out, k );
+		if ( f < INCLUDE_DEPTH )
+		{
+			out << "#include \"asmbench" << f + 1 << ".asm\"\n";
+			written++;
+		}
+	}
+	return written;
+}
+
+// instructions per second of Machine::disassemble() over whole assembled image
+static void disasmBenchmark()
+{
+	Simpleton::Machine m;
+	Simpleton::Assembler a( &m );
+	if ( !a.parseFile( "asmbench0.asm" ) )
+		return;
+	char line[ Simpleton::DISASM_TEXT ];
+	uint64_t count = 0, chars = 0;
+	auto start = std::chrono::steady_clock::now();
+	double seconds;
+	do
+	{
+		for ( Simpleton::mWord addr = 0; addr < Simpleton::PORT_START - 2; count++ )
+			chars += m.disassemble( addr, line ) - line;
+		seconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count();
+	} while ( seconds < 0.5 );
+	std::cout << "Disassembled: " << std::setw( 8 ) << count << "  Instructions/s: " << std::setw( 10 ) << uint64_t( count / seconds );
+	std::cout << "  Chars: " << chars << "\n";
+}
+
+int main( int argc, char *argv[] )
+{
+	int maxLines = (argc > 1) ? atoi( argv[ 1 ] ) : 100000;
+	Simpleton::Assembler a;
+	for ( int size = 1000; size <= maxLines; size *= 10 )
+	{
+		int lines = generate( size );
+		// small sources are repeated to get measurable time
+		int runs = 0;
+		auto start = std::chrono::steady_clock::now();
+		double seconds;
+		do
+		{
+			a.reset();
+			if ( !a.parseFile( "asmbench0.asm" ) )
+			{
+				std::cout << a.getErrorMessage() << "\n";
+				return 1;
+			}
+			runs++;
+			seconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count();
+		} while ( seconds < 0.5 );
+		std::cout << "Lines: " << std::setw( 8 ) << lines << "  Runs: " << std::setw( 5 ) << runs;
+		std::cout << "  Lines/s: " << std::setw( 10 ) << uint64_t( lines * runs / seconds );
+		std::cout << "  Peak memory: " << peakMemory() << " KB\n";
+	}
+	disasmBenchmark();
+	for ( int f = 0; f <= INCLUDE_DEPTH; f++ )
+		remove( ("asmbench" + std::to_string( f ) + ".asm").c_str() );
+	return 0;
+}
@@ -0,0 +1,209 @@
+#include "simpleton4.h"
+#include <random>
+#include <cstring>
+#include <functional>
+
+// Differential fuzzer: random programs run in lockstep under reference Machine::step()
+// and every registered engine, first diverging register or memory word is reported.
+// usage: fuzz [cases] [steps] [seed]
+
+using namespace Simpleton;
+
+struct Engine
+{
+	const char	*name;
+	// loads image into fresh machine
+	std::function< void( Machine &m, const std::vector< mWord > &image ) >	load;
+	// executes one instruction
+	std::function< void( Machine &m ) >	step;
+};
+
+static void loadPrivate( Machine &m, const std::vector< mWord > &image )
+{
+	for ( size_t i = 0; i < image.size(); i++ )
+	{
+		if ( image[ i ] != 0 )
+			m.getBus()->write( mWord( i ), image[ i ] );
+	}
+}
+
+static std::vector< Engine > engines =
+{
+	{ "run", loadPrivate, []( Machine &m ) { m.run( 1 ); } },
+	// breakpoint far away only arms debug loop of run()
+	{ "debug", []( Machine &m, const std::vector< mWord > &image )
+		{
+			loadPrivate( m, image );
+			m.setBreakpoint( PORT_START );
+		}, []( Machine &m ) { m.run( 1 ); } },
+	// memory is copy-on-write image of other bus
+	{ "shared", []( Machine &m, const std::vector< mWord > &image )
+		{
+			Bus owner;
+			for ( size_t i = 0; i < image.size(); i++ )
+				owner.write( mWord( i ), image[ i ] );
+			m.getBus()->load( *owner.share() );
+		}, []( Machine &m ) { m.run( 1 ); } },
+	{ "blocks", []( Machine &m, const std::vector< mWord > &image )
+		{
+			loadPrivate( m, image );
+			m.setBlockEngine( true );
+		}, []( Machine &m ) { m.run( 1 ); } },
+	// small limit thins checkpoints, every step goes back halfway and forward again
+	{ "rewind", []( Machine &m, const std::vector< mWord > &image )
+		{
+			loadPrivate( m, image );
+			m.setCheckpoints( 8, 16 );
+		}, []( Machine &m )
+		{
+			m.run( 1 );
+			uint64_t now = m.getRetired();
+			m.rewind( now / 2 );
+			m.rewind( now );
+		} },
+};
+
+// instruction word, operands are biased towards PC, SP and PSW where special cases live
+static mWord randomInstruction( std::mt19937 &rnd )
+{
+	if ( rnd() & 1 )
+		return mWord( rnd() );
+	mTag field[ 3 ];
+	for ( auto &f : field )
+	{
+		f = (rnd() & 1) ? (REG_SP + rnd() % 3) : (rnd() & 7);
+		if ( rnd() & 1 )
+			f |= 8;	// indirect
+	}
+	return Instruction::encode( rnd() & 15, field[ 0 ], field[ 1 ], field[ 2 ] );
+}
+
+// few pages of random code and data, including pages of PC and SP, rest zero
+static std::vector< mWord > randomImage( std::mt19937 &rnd, mWord pc, mWord sp )
+{
+	std::vector< mWord > image( PORT_START, 0 );
+	int pages[ 8 ] = { pc >> PAGE_SHIFT, mWord( sp - 1 ) >> PAGE_SHIFT };
+	for ( int i = 2; i < 8; i++ )
+		pages[ i ] = rnd() % (PORT_START >> PAGE_SHIFT);
+	for ( int p : pages )
+	{
+		if ( p >= (PORT_START >> PAGE_SHIFT) )
+			continue;	// stack below I/O page wrapped
+		for ( int i = 0; i < PAGE_WORDS; i++ )
+		{
+			mWord &w = image[ (p << PAGE_SHIFT) + i ];
+			// addresses into nearby code and data are more useful than random ones
+			w = (rnd() % 4) ? randomInstruction( rnd ) : mWord( rnd() % PORT_START );
+		}
+	}
+	return image;
+}
+
+static void reportState( Machine &m )
+{
+	for ( int r = 0; r < 8; r++ )
+		std::cout << "R" << r << ":" << std::setw( 4 ) << m.getReg( r ) << " ";
+	std::cout << "\n";
+}
+
+// first difference in state of engine against reference, empty if none
+static std::string compare( Machine &ref, const std::string &refOut, Machine &m )
+{
+	std::stringstream ss;
+	ss << std::uppercase << std::hex << std::setfill( '0' );
+	for ( int r = 0; r < 8; r++ )
+	{
+		if ( ref.getReg( r ) != m.getReg( r ) )
+		{
+			ss << "R" << r << " $" << std::setw( 4 ) << ref.getReg( r ) << " != $" << std::setw( 4 ) << m.getReg( r );
+			return ss.str();
+		}
+	}
+	if ( ref.getCycles() != m.getCycles() )
+	{
+		ss << std::dec << "cycles " << ref.getCycles() << " != " << m.getCycles();
+		return ss.str();
+	}
+	for ( int p = 0; p < (PORT_START >> PAGE_SHIFT); p++ )
+	{
+		const mWord *refPage = ref.getBus()->pageForRead( p << PAGE_SHIFT );
+		const mWord *page = m.getBus()->pageForRead( p << PAGE_SHIFT );
+		if ( memcmp( refPage, page, PAGE_WORDS * sizeof( mWord ) ) == 0 )
+			continue;
+		for ( int i = 0; i < PAGE_WORDS; i++ )
+		{
+			if ( refPage[ i ] != page[ i ] )
+			{
+				ss << "[ $" << std::setw( 4 ) << ((p << PAGE_SHIFT) + i) << " ] $" << std::setw( 4 ) << refPage[ i ] << " != $" << std::setw( 4 ) << page[ i ];
+				return ss.str();
+			}
+		}
+	}
+	std::string out = m.getBus()->takeOutput();
+	if ( refOut != out )
+	{
+		ss << "console output '" << refOut << "' != '" << out << "'";
+		return ss.str();
+	}
+	return "";
+}
+
+int main( int argc, char *argv[] )
+{
+	int cases = (argc > 1) ? atoi( argv[ 1 ] ) : 1000;
+	int steps = (argc > 2) ? atoi( argv[ 2 ] ) : 1000;
+	uint32_t seed = (argc > 3) ? strtoul( argv[ 3 ], nullptr, 10 ) : std::random_device()();
+	std::cout << "Seed: " << seed << "\n";
+
+	uint64_t total = 0;
+	for ( int c = 0; c < cases; c++ )
+	{
+		// every case is reproducible from its own seed
+		std::mt19937 rnd( seed + c );
+		mWord pc = rnd() % PORT_START;
+		mWord sp = rnd() % PORT_START;
+		std::vector< mWord > image = randomImage( rnd, pc, sp );
+
+		std::vector< std::unique_ptr< Machine > > machines;
+		for ( size_t e = 0; e <= engines.size(); e++ )
+		{
+			machines.emplace_back( new Machine() );
+			Machine &m = *machines.back();
+			// console never blocks, reads of empty input return 0
+			m.getBus()->setHostConsole( true );
+			if ( e == 0 )
+				loadPrivate( m, image );
+			else
+				engines[ e - 1 ].load( m, image );
+			m.setReg( REG_PC, pc );
+			m.setReg( REG_SP, sp );
+		}
+		Machine &ref = *machines[ 0 ];
+
+		for ( int s = 0; (s < steps) && (ref.currentOp() != 0); s++, total++ )
+		{
+			mWord at = ref.getPC();
+			ref.step();
+			std::string refOut = ref.getBus()->takeOutput();
+			for ( size_t e = 0; e < engines.size(); e++ )
+			{
+				Machine &m = *machines[ e + 1 ];
+				engines[ e ].step( m );
+				std::string diff = compare( ref, refOut, m );
+				if ( diff.empty() )
+					continue;
+				std::cout << std::uppercase << std::hex << std::setfill( '0' );
+				std::cout << "Engine '" << engines[ e ].name << "' diverged in case " << std::dec << c << " (seed " << seed + c << ") at step " << s << ": " << diff << "\n";
+				std::cout << std::hex;
+				ref.showDisasm( at );
+				std::cout << "reference ";
+				reportState( ref );
+				std::cout << engines[ e ].name << " ";
+				reportState( m );
+				return 1;
+			}
+		}
+	}
+	std::cout << std::dec << "Cases: " << cases << "  Instructions: " << total << "  Engines: " << engines.size() << "  No divergence\n";
+	return 0;
+}
@@ -1,19 +1,411 @@
 #include "simpleton4asm.h"
+#include "simpleton4co.h"
+#include "simpleton4hle.h"
+#include <cstdio>
+
+// '$hex', decimal or label name
+static bool resolveAddr( Simpleton::Assembler &a, const std::string &text, Simpleton::mWord &addr )
+{
+	if ( text[ 0 ] == '$' )
+		addr = strtol( text.c_str() + 1, nullptr, 16 );
+	else if ( isdigit( text[ 0 ] ) )
+		addr = strtol( text.c_str(), nullptr, 10 );
+	else
+	{
+		for ( auto &s : a.getSymbols( true ) )
+		{
+			if ( s.name == text )
+			{
+				addr = s.addr;
+				return true;
+			}
+		}
+		return false;
+	}
+	return true;
+}
+
+// many machines multiplexed on few threads, each gets same console input
+static int runInstances( int count, const std::string &input )
+{
+	std::vector< std::unique_ptr< Simpleton::Machine > > machines;
+	Simpleton::Executor executor( std::max( 1u, std::thread::hardware_concurrency() ) );
+	// program is assembled once, machines share its pages until they write them
+	std::shared_ptr< Simpleton::SharedImage > image;
+	for ( int i = 0; i < count; i++ )
+	{
+		machines.emplace_back( new Simpleton::Machine() );
+		Simpleton::Machine &m = *machines.back();
+		m.getBus()->setHostConsole( true );
+		if ( image )
+		{
+			m.getBus()->load( *image );
+			continue;
+		}
+		Simpleton::Assembler a( &m );
+		if ( !a.parseFile( "source.asm" ) )
+		{
+			std::cout << a.getErrorMessage() << "\n";
+			return 1;
+		}
+		image = m.getBus()->share();
+	}
+	for ( auto &m : machines )
+		executor.spawn( Simpleton::runAsync( executor, *m ) );
+	// input arrives while guests are waiting for it
+	for ( char c : input )
+	{
+		for ( auto &m : machines )
+			m->getBus()->pushInput( std::string( 1, c ) );
+	}
+	executor.wait();
+
+	uint64_t total = 0;
+	for ( auto &m : machines )
+		total += m->getRetired();
+	std::cout << machines[ 0 ]->getBus()->takeOutput() << "\n";
+	std::cout << std::dec << "Machines: " << count << "  Instructions: " << total << "\n";
+	return 0;
+}
 
 int main( int argc, char *argv[] )
 {
-	Simpleton::Machine m;
-	Simpleton::Assembler a( &m );
+	Simpleton::Bus bus;
+	std::vector< std::unique_ptr< Simpleton::Machine > > cores;
+	Simpleton::CostModel cost;
+	int coreCount = 1;
+	bool debug = false;
+	bool prof = false;
+	bool blocks = false;
+	bool hle = false;
+	bool hleCheck = false;
+	bool optimize = false;
+	std::string cacheDir;
+	unsigned long long checkpointInterval = 0, rewindTo = 0;
+	size_t checkpointLimit = 65536;
+	bool rewind = false;
+	std::vector< std::string > breaks, watches;
+	std::string recordFile, replayFile, listFile, heatFile, frameDir, frameShared;
+	unsigned long long frameInterval = 100000;
+	unsigned heatInterval = 1;
 
+	for ( int i = 1; i < argc; i++ )
+	{
+		std::string arg = argv[ i ];
+		if ( arg == "d" )
+		{
+			debug = true;
+		}
+		else if ( arg == "prof" )
+		{
+			prof = true;
+		}
+		else if ( (arg == "cost") && (i + 1 < argc) )
+		{
+			// opcode,immediate,read,write,port
+			if ( sscanf( argv[ ++i ], "%d,%d,%d,%d,%d", &cost.opcode, &cost.immediate, &cost.read, &cost.write, &cost.port ) != 5 )
+			{
+				std::cout << "Cost model must be 'opcode,immediate,read,write,port'\n";
+				return 1;
+			}
+		}
+		else if ( (arg == "async") && (i + 2 < argc) )
+		{
+			// program must finish on this input or run never ends
+			int count = atoi( argv[ ++i ] );
+			std::string input = argv[ ++i ];
+			return runInstances( std::max( count, 1 ), input );
+		}
+		else if ( (arg == "cores") && (i + 1 < argc) )
+		{
+			coreCount = atoi( argv[ ++i ] );
+			if ( coreCount < 1 )
+			{
+				std::cout << "Number of cores must be positive\n";
+				return 1;
+			}
+		}
+		else if ( (arg == "break") && (i + 1 < argc) )
+		{
+			breaks.push_back( argv[ ++i ] );
+		}
+		else if ( (arg == "watch") && (i + 1 < argc) )
+		{
+			watches.push_back( argv[ ++i ] );
+		}
+		else if ( (arg == "hle") || (arg == "hlecheck") )
+		{
+			// native routines for 'hook' directives and known symbols
+			hle = true;
+			hleCheck = (arg == "hlecheck");
+		}
+		else if ( arg == "opt" )
+		{
+			optimize = true;
+		}
+		else if ( arg == "blocks" )
+		{
+			blocks = true;
+		}
+		else if ( (arg == "cache") && (i + 1 < argc) )
+		{
+			// blocks decoded by run are reused by next run of same program
+			blocks = true;
+			cacheDir = argv[ ++i ];
+		}
+		else if ( (arg == "checkpoint") && (i + 1 < argc) )
+		{
+			// interval[,limitKB]
+			if ( sscanf( argv[ ++i ], "%llu,%zu", &checkpointInterval, &checkpointLimit ) < 1 )
+			{
+				std::cout << "Checkpoints must be 'interval[,limitKB]'\n";
+				return 1;
+			}
+		}
+		else if ( (arg == "back") && (i + 1 < argc) )
+		{
+			// state after this many instructions is shown at end
+			rewind = true;
+			rewindTo = strtoull( argv[ ++i ], nullptr, 10 );
+		}
+		else if ( (arg == "list") && (i + 1 < argc) )
+		{
+			// disassembly of assembled image with labels, written before run
+			listFile = argv[ ++i ];
+		}
+		else if ( (arg == "heat") && (i + 1 < argc) )
+		{
+			// file[,interval], '.csv' file gets totals by page and symbol, other raw counters
+			std::string spec = argv[ ++i ];
+			size_t comma = spec.find( ',' );
+			heatFile = spec.substr( 0, comma );
+			if ( comma != std::string::npos )
+				heatInterval = std::max( atoi( spec.c_str() + comma + 1 ), 1 );
+		}
+		else if ( (arg == "frames") && (i + 1 < argc) )
+		{
+			// dir[,cycles]: PPM file of display for every frame with changes
+			std::string spec = argv[ ++i ];
+			size_t comma = spec.find( ',' );
+			frameDir = spec.substr( 0, comma );
+			if ( comma != std::string::npos )
+				frameInterval = strtoull( spec.c_str() + comma + 1, nullptr, 10 );
+		}
+		else if ( (arg == "fbshared") && (i + 1 < argc) )
+		{
+			// display pixels as RGB bytes in file mapped by viewer
+			frameShared = argv[ ++i ];
+		}
+		else if ( (arg == "record") && (i + 1 < argc) )
+		{
+			recordFile = argv[ ++i ];
+		}
+		else if ( (arg == "replay") && (i + 1 < argc) )
+		{
+			replayFile = argv[ ++i ];
+		}
+		else if ( (arg == "disk") && (i + 1 < argc) )
+		{
+			if ( !bus.attachStorage( argv[ ++i ] ) )
+			{
+				std::cout << "Cannot attach disk image '" << argv[ i ] << "'\n";
+				return 1;
+			}
+		}
+	}
+	if ( (coreCount > 1) && (!recordFile.empty() || !replayFile.empty()) )
+	{
+		std::cout << "Record and replay need single core\n";
+		return 1;
+	}
+	if ( (coreCount > 1) && blocks )
+	{
+		std::cout << "Block engine needs single core\n";
+		return 1;
+	}
+	if ( (coreCount > 1) && (checkpointInterval || rewind) )
+	{
+		std::cout << "Checkpoints need single core\n";
+		return 1;
+	}
+	if ( (coreCount > 1) && !heatFile.empty() )
+	{
+		std::cout << "Heatmap needs single core\n";
+		return 1;
+	}
+	if ( rewind && !checkpointInterval )
+		checkpointInterval = 100000;
+
+	for ( int i = 0; i < coreCount; i++ )
+	{
+		cores.emplace_back( new Simpleton::Machine( &bus ) );
+		cores.back()->setCostModel( cost );
+		cores.back()->setProfiling( prof );
+	}
+	Simpleton::Machine &m = *cores[ 0 ];
+	if ( !recordFile.empty() )
+		m.recordPorts();
+	if ( !replayFile.empty() && !m.replayPorts( replayFile ) )
+	{
+		std::cout << "Cannot read replay log '" << replayFile << "'\n";
+		return 1;
+	}
+
+	Simpleton::Assembler a( &m );
+	a.setOptimize( optimize );
 	if ( a.parseFile( "source.asm" ) )
 	{
-		while ( m.currentOp() != 0 )	// nop as stop
+		if ( optimize )
+		{
+			const Simpleton::PeepholeStats &stats = a.getPeepholeStats();
+			std::cout << "Peephole: " << stats.rewritten << " instructions rewritten, " << stats.words << " words and " << stats.cycles << " cycles (default cost model) saved\n";
+		}
+		Simpleton::mWord addr;
+		for ( auto &b : breaks )
 		{
-			if ( (argc > 1) && (std::string( "d" ) == argv[ 1 ]) )
+			if ( !resolveAddr( a, b, addr ) )
+			{
+				std::cout << "Unknown breakpoint address '" << b << "'\n";
+				return 1;
+			}
+			for ( auto &c : cores )
+				c->setBreakpoint( addr );
+		}
+		for ( auto &w : watches )
+		{
+			if ( !resolveAddr( a, w, addr ) )
+			{
+				std::cout << "Unknown watchpoint address '" << w << "'\n";
+				return 1;
+			}
+			for ( auto &c : cores )
+				c->setWatchpoint( addr, true, true );
+		}
+
+		if ( !listFile.empty() )
+		{
+			std::ofstream out( listFile );
+			m.listing( out, 0, Simpleton::PORT_START - 1, a.getSymbols( true ) );
+			if ( !out )
+			{
+				std::cout << "Cannot write listing '" << listFile << "'\n";
+				return 1;
+			}
+		}
+		if ( hle )
+		{
+			for ( auto &h : a.getHooks() )
+			{
+				if ( !Simpleton::findHook( h.name ) )
+				{
+					std::cout << "Unknown native routine '" << h.name << "'\n";
+					return 1;
+				}
+			}
+			int count = 0;
+			for ( auto &c : cores )
+			{
+				count = Simpleton::installHooks( *c, a.getHooks() ) + Simpleton::installHooks( *c, a.getSymbols() );
+				c->setHookValidation( hleCheck );
+			}
+			std::cout << "Hooks: " << count << "\n";
+		}
+		if ( !heatFile.empty() )
+			m.setHeatmap( true, heatInterval );
+		bool display = !frameDir.empty() || !frameShared.empty();
+		if ( display )
+		{
+			if ( !bus.getDisplay().attach( Simpleton::DISPLAY_BASE, frameDir, frameShared ) )
+			{
+				std::cout << "Cannot attach display to '" << (frameShared.empty() ? frameDir : frameShared) << "'\n";
+				return 1;
+			}
+			// first core produces frames, writes of all are tracked
+			for ( auto &c : cores )
+				c->setFrameInterval( (c == cores[ 0 ]) ? std::max( frameInterval, 1ull ) : 0 );
+		}
+		if ( checkpointInterval )
+			m.setCheckpoints( checkpointInterval, checkpointLimit );
+		if ( !cacheDir.empty() )
+			std::cout << "Block cache " << (m.loadBlocks( cacheDir ) ? "loaded\n" : "is empty\n");
+		else if ( blocks )
+			m.setBlockEngine( true );
+		if ( coreCount == 1 )
+		{
+			Simpleton::Machine::StopReason reason;
+			// single steps of debug mode stop at breakpoints, only start PC is passed
+			bool resume = true;
+			do
+			{
+				if ( debug )
+					m.showDisasm( m.getPC() );
+				reason = m.run( debug ? 1 : UINT64_MAX, resume );
+				resume = false;
+			} while ( reason == Simpleton::Machine::StopLimit );
+		}
+		else
+		{
+			// every core runs the same program on its own host thread
+			std::vector< std::thread > threads;
+			for ( auto &c : cores )
+				threads.emplace_back( [ &c ]() { c->run(); } );
+			for ( auto &t : threads )
+				t.join();
+		}
+
+		for ( auto &c : cores )
+		{
+			Simpleton::Machine::StopReason reason = c->getStopReason();
+			if ( coreCount > 1 )
+				std::cout << "Core " << c->getCoreId() << ":\n";
+			if ( reason == Simpleton::Machine::StopBreakpoint )
+				std::cout << "Breakpoint at ";
+			else if ( reason == Simpleton::Machine::StopReadWatch )
+				std::cout << "Read watchpoint at ";
+			else if ( reason == Simpleton::Machine::StopWriteWatch )
+				std::cout << "Write watchpoint at ";
+			else if ( reason == Simpleton::Machine::StopReplay )
+				std::cout << "Replay log diverged at port ";
+			else if ( reason == Simpleton::Machine::StopHook )
+				std::cout << "Native routine differs (" << c->getHookDiff() << ") at ";
+			if ( reason != Simpleton::Machine::StopHalt )
+				std::cout << std::uppercase << std::hex << std::setw( 4 ) << std::setfill( '0' ) << c->getStopAddr() << "\n";
+			c->show( c == cores.back() );
+			std::cout << std::dec << "Instructions: " << c->getRetired() << "  Cycles: " << c->getCycles() << "\n";
+			if ( prof )
+				c->showProfile( a.getSymbols() );
+		}
+		// re-execution of rewind is not counted
+		if ( !heatFile.empty() )
+		{
+			bool csv = (heatFile.size() > 4) && (heatFile.compare( heatFile.size() - 4, 4, ".csv" ) == 0);
+			if ( !m.saveHeatmap( heatFile, a.getSymbols(), csv ) )
+				std::cout << "Cannot write heatmap '" << heatFile << "'\n";
+		}
+		if ( rewind )
+		{
+			if ( m.rewind( rewindTo ) )
+			{
+				std::cout << std::dec << "Back at instruction " << rewindTo << "  Cycles: " << m.getCycles() << "  Checkpoints: " << m.getCheckpointCount() << "\n";
+				m.show( false );
 				m.showDisasm( m.getPC() );
-			m.step();
+			}
+			else
+				std::cout << std::dec << "Cannot go back to instruction " << rewindTo << "\n";
+		}
+		if ( display )
+		{
+			// changes after last frame event
+			if ( !bus.getDisplay().frame( bus ) )
+				std::cout << "Cannot write frames to '" << frameDir << "'\n";
+			std::cout << std::dec << "Frames: " << bus.getDisplay().getFrames() << "\n";
 		}
-		m.show();
+		if ( blocks )
+			std::cout << "Blocks built: " << m.getBlocksBuilt() << "\n";
+		if ( !cacheDir.empty() && !m.saveBlocks() )
+			std::cout << "Cannot write block cache to '" << cacheDir << "'\n";
+		if ( !recordFile.empty() && !m.savePortLog( recordFile ) )
+			std::cout << "Cannot write replay log '" << recordFile << "'\n";
 	}
 	else
 	{
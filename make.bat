@@ -1,4 +1,8 @@
 rem SET CC=c:\devel\mingw\bin\g++.exe
 SET CC=g++
-%CC% -static -march=native -ffast-math -O2 -masm=intel main.cpp simpleton4.cpp simpleton4asm.cpp -o simpleton.exe
+%CC% -std=c++20 -static -march=native -ffast-math -O2 -masm=intel main.cpp simpleton4.cpp simpleton4dev.cpp simpleton4asm.cpp simpleton4co.cpp simpleton4hle.cpp -o simpleton.exe
+%CC% -std=c++20 -static -march=native -ffast-math -O2 -masm=intel fuzz.cpp simpleton4.cpp simpleton4dev.cpp -o fuzz.exe
+%CC% -std=c++20 -static -march=native -ffast-math -O2 -masm=intel asmbench.cpp simpleton4.cpp simpleton4dev.cpp simpleton4asm.cpp -o asmbench.exe -lpsapi
+%CC% -std=c++20 -static -march=native -ffast-math -O2 -masm=intel aot.cpp simpleton4.cpp simpleton4dev.cpp simpleton4asm.cpp -o aot.exe
+rem aot source.asm out.cpp && %CC% -std=c++20 -static -O2 out.cpp simpleton4.cpp simpleton4dev.cpp -o out.exe
 rem 2> log
\ No newline at end of file
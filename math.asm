@@ -0,0 +1,68 @@
+; Math coprocessor ports and drop-in routines.
+; Switches assembler to 'mode new', restore your mode after #include if needed.
+; Every routine is entered with 'call' and keeps registers not listed as outputs.
+
+		mode new
+
+MATH_X_LO	= $FFF0
+MATH_X_HI	= $FFF1
+MATH_Y		= $FFF2
+MATH_CMD	= $FFF3
+MATH_RES_LO	= $FFF4
+MATH_RES_HI	= $FFF5
+MATH_REM	= $FFF6
+
+MATH_MUL	= 1
+MATH_IMUL	= 2
+MATH_DIV	= 3
+MATH_IDIV	= 4
+
+; r1:r0 = r0 * r1 (unsigned)
+mul16		[ MATH_X_LO ] <- r0
+		[ MATH_Y ] <- r1
+		[ MATH_CMD ] <- MATH_MUL
+		r0 <- [ MATH_RES_LO ]
+		r1 <- [ MATH_RES_HI ]
+		ret
+
+; r1:r0 = r0 * r1 (signed)
+imul16		[ MATH_X_LO ] <- r0
+		[ MATH_Y ] <- r1
+		[ MATH_CMD ] <- MATH_IMUL
+		r0 <- [ MATH_RES_LO ]
+		r1 <- [ MATH_RES_HI ]
+		ret
+
+; r1:r0 = r1:r0 / r2, r2 = r1:r0 % r2 (unsigned)
+; ZF is cleared on division by zero
+div32		[ MATH_X_LO ] <- r0
+		[ MATH_X_HI ] <- r1
+		[ MATH_Y ] <- r2
+		[ MATH_CMD ] <- MATH_DIV
+		r0 <- [ MATH_RES_LO ]
+		r1 <- [ MATH_RES_HI ]
+		r2 <- [ MATH_REM ]
+		void <= [ MATH_CMD ]	; test status
+		ret
+
+; r1:r0 = r1:r0 / r2, r2 = r1:r0 % r2 (signed)
+; ZF is cleared on division by zero or overflow
+idiv32		[ MATH_X_LO ] <- r0
+		[ MATH_X_HI ] <- r1
+		[ MATH_Y ] <- r2
+		[ MATH_CMD ] <- MATH_IDIV
+		r0 <- [ MATH_RES_LO ]
+		r1 <- [ MATH_RES_HI ]
+		r2 <- [ MATH_REM ]
+		void <= [ MATH_CMD ]
+		ret
+
+; r0 = r0 / r1, r1 = r0 % r1 (unsigned)
+div16		[ MATH_X_LO ] <- r0
+		[ MATH_X_HI ] <- 0
+		[ MATH_Y ] <- r1
+		[ MATH_CMD ] <- MATH_DIV
+		r0 <- [ MATH_RES_LO ]
+		r1 <- [ MATH_REM ]
+		void <= [ MATH_CMD ]
+		ret
@@ -1,14 +1,27 @@
 #include "simpleton4.h"
 #include <conio.h>
+#include <algorithm>
+#include <cstring>
+#include <sstream>
 
 namespace Simpleton
 {
 
+static const size_t MAX_BLOCK_OPS = 64;
+// guest routine checked against hook must return within this number of steps
+static const uint64_t MAX_HOOK_STEPS = 100000000;
+// cached blocks of other format or decoder are not loaded
+static const mWord BLOCK_CACHE_MAGIC = 0x4B42;	// 'BK'
+static const mWord BLOCK_CACHE_VERSION = 1;
+
 /*static*/ bool Instruction::isInplaceImmediate( mTag cmd )
 {
 	return (cmd == OP_ADDI) || (cmd == OP_ADDIS) || (cmd == OP_RRCI);
 }
 
+// untouched memory, never written as it is always shared
+static const PagePtr zeroPage = std::make_shared< Page >();
+
 static const char *NameCmds[] = {
 "addis",
 "addi ",
@@ -22,7 +35,10 @@ static const char *NameCmds[] = {
 "xor  ",
 "cadd ",
 "rrci ",
-"rrc  " };
+"rrc  ",
+"???  ",	// undefined opcodes
+"???  ",
+"???  " };
 
 static const char *NameRegs[] = {
 "r0",
@@ -43,83 +59,808 @@ static const char *NameRegs[] = {
 "[ pw ]"
 };
 
-std::string Machine::operandToStr( mTag r, mTag i, int &addr, bool result )
+// texts are prepared once, disassembly only copies fixed size pieces of them
+struct DisasmTables
 {
-	std::stringstream ss;
-	if ( result && (i == 1) && (r == REG_PC) )
+	char	hex[ 256 ][ 2 ];	// digit pairs of byte values
+	char	operand[ 16 ][ 8 ];	// NameRegs padded for single copy
+	int	operandLength[ 16 ];
+	char	inplace[ 16 ][ 2 ];	// in-place immediates by x + xi * 8
+	int	inplaceLength[ 16 ];
+
+	DisasmTables()
 	{
-		ss << "void";
+		static const char digits[] = "0123456789ABCDEF";
+		for ( int i = 0; i < 256; i++ )
+		{
+			hex[ i ][ 0 ] = digits[ i >> 4 ];
+			hex[ i ][ 1 ] = digits[ i & 15 ];
+		}
+		for ( int i = 0; i < 16; i++ )
+		{
+			operandLength[ i ] = strlen( NameRegs[ i ] );
+			memset( operand[ i ], ' ', sizeof( operand[ i ] ) );
+			memcpy( operand[ i ], NameRegs[ i ], operandLength[ i ] );
+			int value = (i < 8) ? i : i - 16;
+			inplaceLength[ i ] = (value < 0) ? 2 : 1;
+			inplace[ i ][ 0 ] = (value < 0) ? '-' : digits[ value ];
+			inplace[ i ][ 1 ] = (value < 0) ? digits[ -value ] : ' ';
+		}
 	}
-	else if ( (i == 1) && (r == REG_PC) )
+};
+static const DisasmTables disasmTables;
+
+static char *hex4( char *p, mWord w )
+{
+	memcpy( p, disasmTables.hex[ w >> 8 ], 2 );
+	memcpy( p + 2, disasmTables.hex[ w & 0xFF ], 2 );
+	return p + 4;
+}
+
+// immediate without leading zeros
+static char *hexTrim( char *p, mWord w )
+{
+	int digits = (w >= 0x1000) ? 4 : (w >= 0x100) ? 3 : (w >= 0x10) ? 2 : 1;
+	for ( int i = digits - 1; i >= 0; i-- )
 	{
-		ss << "$" << std::uppercase << std::hex << getMem( addr++ );
+		p[ i ] = "0123456789ABCDEF"[ w & 15 ];
+		w >>= 4;
 	}
-	else if ( (i == 1) && (r == REG_PSW) )
+	return p + digits;
+}
+
+// operand with immediate word at given address
+char *Machine::operandText( char *p, mTag r, bool i, mWord at, bool result )
+{
+	if ( i && (r == REG_PC) )
 	{
-		ss << "[ $" << std::uppercase << std::hex << std::setw( 4 ) << std::setfill( '0' ) << getMem( addr++ ) << " ]";
+		if ( result )
+		{
+			memcpy( p, "void", 4 );
+			return p + 4;
+		}
+		*p++ = '$';
+		return hexTrim( p, peek( at ) );
 	}
-	else
+	if ( i && (r == REG_PSW) )
 	{
-		ss << NameRegs[ i * 8 + r ];
+		memcpy( p, "[ $", 3 );
+		p = hex4( p + 3, peek( at ) );
+		memcpy( p, " ]", 2 );
+		return p + 2;
 	}
-	return ss.str();
-};
+	memcpy( p, disasmTables.operand[ i * 8 + r ], 8 );
+	return p + disasmTables.operandLength[ i * 8 + r ];
+}
 
-void Machine::showDisasm( int addr )
+char *Machine::disassemble( mWord &addr, char *out )
 {
-	Instruction instr;
-	std::string sr, sy, sx;
-	std::cout << std::uppercase << std::hex << std::setw( 4 ) << std::setfill( '0' ) << addr  << ": ";
-	instr.decode( getMem( addr++ ) );
-	std::cout << NameCmds[ instr.cmd ] << " ";
-	if ( instr.isInplaceImmediate( instr.cmd ) )
+	Instruction op;
+	char *p = hex4( out, addr );
+	*p++ = ':';
+	*p++ = ' ';
+	op.decode( peek( addr++ ) );
+	memcpy( p, NameCmds[ op.cmd ], 5 );
+	p[ 5 ] = ' ';
+	p += 6;
+	// immediates follow opcode in order X, Y, R while text is R Y X
+	bool inplace = Instruction::isInplaceImmediate( op.cmd );
+	int xWords = (!inplace && op.xi && ((op.x == REG_PC) || (op.x == REG_PSW))) ? 1 : 0;
+	int yWords = (op.yi && ((op.y == REG_PC) || (op.y == REG_PSW))) ? 1 : 0;
+	int rWords = (op.ri && (op.r == REG_PSW)) ? 1 : 0;
+	p = operandText( p, op.r, op.ri, addr + xWords + yWords, true );
+	*p++ = ' ';
+	p = operandText( p, op.y, op.yi, addr + xWords );
+	*p++ = ' ';
+	if ( inplace )
 	{
-		sx = std::to_string( (int) ((instr.xi == 1) ? instr.x - 8 : instr.x) );
+		int k = op.xi * 8 + op.x;
+		memcpy( p, disasmTables.inplace[ k ], 2 );
+		p += disasmTables.inplaceLength[ k ];
 	}
 	else
+		p = operandText( p, op.x, op.xi, addr );
+	addr += xWords + yWords + rWords;
+	*p = 0;
+	return p;
+}
+
+void Machine::showDisasm( int addr )
+{
+	char line[ DISASM_TEXT ];
+	mWord at = addr;
+	disassemble( at, line );
+	std::cout << line << "\n";
+}
+
+void Machine::listing( std::ostream &out, mWord from, mWord to, const std::vector< Symbol > &symbols )
+{
+	char buf[ 16384 ];
+	char *p = buf;
+	auto flush = [ & ]( size_t need )
+	{
+		if ( p + need <= buf + sizeof( buf ) )
+			return;
+		out.write( buf, p - buf );
+		p = buf;
+	};
+	auto sym = std::lower_bound( symbols.begin(), symbols.end(), from,
+			[]( const Symbol &s, mWord a ) { return s.addr < a; } );
+	uint32_t addr = from;
+	while ( addr <= to )
 	{
-		sx = operandToStr( instr.x, instr.xi, addr );
+		// untouched pages without labels are left out
+		uint32_t pageEnd = (addr | (PAGE_WORDS - 1)) + 1;
+		if ( !(addr & (PAGE_WORDS - 1)) && bus->isZeroPage( addr ) &&
+				((sym == symbols.end()) || (sym->addr >= pageEnd)) )
+		{
+			addr = pageEnd;
+			continue;
+		}
+		// label inside operand words of previous instruction is shown before next one
+		for ( ; (sym != symbols.end()) && (sym->addr <= addr); sym++ )
+		{
+			flush( sym->name.size() + 2 );
+			memcpy( p, sym->name.data(), sym->name.size() );
+			p += sym->name.size();
+			*p++ = ':';
+			*p++ = '\n';
+		}
+		flush( DISASM_TEXT + 1 );
+		mWord at = addr;
+		p = disassemble( at, p );
+		*p++ = '\n';
+		// last instruction may wrap around address space
+		addr = (at > addr) ? at : 0x10000;
 	}
-	sy = operandToStr( instr.y, instr.yi, addr );
-	sr = operandToStr( instr.r, instr.ri, addr, true );
-	std::cout << sr << " " << sy << " " << sx << "\n";
-};
+	out.write( buf, p - buf );
+}
 
 
-void Machine::reset()
+void Bus::reset()
 {
-	for ( int i = 0; i < 65536; i++ )
-		mem[ i ] = 0;
-	for ( int i = 0; i < 8; i++ )
-		reg[ i ] = 0;
+	// pages are allocated on first write, this also drops any shared image
+	phys.assign( PAGES, zeroPage );
+	mmuEnabled = false;
+	mmuBank = 0;
+	for ( int i = 0; i < MMU_BANKS; i++ )
+	{
+		mmuFrame[ i ] = i;
+		mapBank( i );
+	}
+	disk.reset();
+	for ( auto &l : locks )
+		l = 0;
 }
 
-mWord Machine::getMem( mWord addr )
+void Bus::mapBank( int index )
 {
-	if ( addr < PORT_START )
+	mWord frame = mmuEnabled ? mmuFrame[ index ] : index;
+	for ( int i = 0; i < BANK_PAGES; i++ )
+		mapPage( index * BANK_PAGES + i, frame * BANK_PAGES + i );
+}
+
+void Bus::mapPage( int page, uint32_t physical )
+{
+	// frames above phys were never written
+	const PagePtr &p = (physical < phys.size()) ? phys[ physical ] : zeroPage;
+	physPage[ page ] = physical;
+	readPage[ page ].store( p->data, std::memory_order_release );
+	// zero page is never written, even when no bus holds it any more
+	writePage[ page ].store( ((p != zeroPage) && (p.use_count() == 1)) ? p->data : nullptr, std::memory_order_release );
+}
+
+bool Bus::isZeroPage( mWord addr )
+{
+	return pageForRead( addr ) == zeroPage->data;
+}
+
+mWord *Bus::privatize( int page )
+{
+	std::lock_guard< std::mutex > guard( pageMutex );
+	uint32_t physical = physPage[ page ];
+	if ( physical >= phys.size() )
+		phys.resize( physical + 1, zeroPage );
+	PagePtr &p = phys[ physical ];
+	if ( (p == zeroPage) || (p.use_count() > 1) )	// last owner takes page without copy
+		p = std::make_shared< Page >( *p );
+	// physical page may be mapped at more places
+	for ( int i = 0; i < PAGES; i++ )
 	{
-		return mem[ addr ];
+		if ( physPage[ i ] == physical )
+			mapPage( i, physical );
 	}
+	return writePage[ page ].load( std::memory_order_relaxed );
+}
+
+std::shared_ptr< SharedImage > Bus::share()
+{
+	std::shared_ptr< SharedImage > image = std::make_shared< SharedImage >();
+	for ( int i = 0; i < PAGES; i++ )
+		image->pages[ i ] = phys[ i ];
+	for ( int i = 0; i < MMU_BANKS; i++ )
+		mapBank( i );
+	return image;
+}
+
+void Bus::load( const SharedImage &image )
+{
+	for ( int i = 0; i < PAGES; i++ )
+		phys[ i ] = image.pages[ i ];
+	for ( int i = 0; i < MMU_BANKS; i++ )
+		mapBank( i );
+}
+
+BusSnapshot Bus::snapshot()
+{
+	BusSnapshot snap;
+	snap.phys = phys;
+	std::copy( mmuFrame, mmuFrame + MMU_BANKS, snap.mmuFrame );
+	snap.mmuBank = mmuBank;
+	snap.mmuEnabled = mmuEnabled;
+	snap.disk = disk.getRegisters();
+	// pages are shared now
+	for ( int i = 0; i < MMU_BANKS; i++ )
+		mapBank( i );
+	return snap;
+}
+
+void Bus::restore( const BusSnapshot &snap )
+{
+	phys = snap.phys;
+	std::copy( snap.mmuFrame, snap.mmuFrame + MMU_BANKS, mmuFrame );
+	mmuBank = snap.mmuBank;
+	mmuEnabled = snap.mmuEnabled;
+	disk.setRegisters( snap.disk );
+	for ( int i = 0; i < MMU_BANKS; i++ )
+		mapBank( i );
+}
+
+mWord Bus::readPort( mWord addr )
+{
+	if ( (addr >= PORT_LOCK_FIRST) && (addr <= PORT_LOCK_LAST) )
+		return locks[ addr - PORT_LOCK_FIRST ].exchange( 1 );
+	std::lock_guard< std::mutex > guard( deviceMutex );
 	if ( addr == PORT_CONSOLE )
 	{
+		if ( hostConsole )
+		{
+			if ( input.empty() )
+			{
+				starved = true;
+				return 0;
+			}
+			mWord c = input.front();
+			input.pop_front();
+			return c;
+		}
 		if ( !kbhit() )
 			return 0;
 		return _getch();
 	}
+	if ( (addr >= PORT_DISK_FIRST) && (addr <= PORT_DISK_LAST) )
+		return disk.read( addr );
+	switch ( addr )
+	{
+	case PORT_MMU_BANK:	return mmuBank;
+	case PORT_MMU_FRAME:	return mmuFrame[ mmuBank ];
+	case PORT_MMU_CTRL:	return mmuEnabled ? 1 : 0;
+	case PORT_MMU_FRAMES:	return MMU_FRAMES;
+	};
 	return 0;
-};
+}
+
+mWord Bus::writePort( mWord addr, mWord data )
+{
+	if ( (addr >= PORT_LOCK_FIRST) && (addr <= PORT_LOCK_LAST) )
+	{
+		locks[ addr - PORT_LOCK_FIRST ].store( data );
+		return 0;
+	}
+	std::lock_guard< std::mutex > guard( deviceMutex );
+	if ( addr == PORT_CONSOLE )
+	{
+		if ( hostConsole )
+			output += static_cast< char >( data );
+		else
+			std::cout << static_cast< char >( data );
+	}
+	else if ( (addr >= PORT_DISK_FIRST) && (addr <= PORT_DISK_LAST) )
+	{
+		disk.write( addr, data, *this );
+		if ( addr == PORT_DISK_CMD )
+			return IRQ_DISK;
+	}
+	else if ( addr == PORT_MMU_BANK )
+	{
+		mmuBank = data & (MMU_BANKS - 1);
+	}
+	else if ( addr == PORT_MMU_FRAME )
+	{
+		if ( data < MMU_FRAMES )	// nonexistent frames are ignored
+		{
+			mmuFrame[ mmuBank ] = data;
+			mapBank( mmuBank );
+		}
+	}
+	else if ( addr == PORT_MMU_CTRL )
+	{
+		mmuEnabled = (data & 1) != 0;
+		for ( int i = 0; i < MMU_BANKS; i++ )
+			mapBank( i );
+	}
+	return 0;
+}
+
+void Bus::pushInput( const std::string &text )
+{
+	std::function< void() > waiter;
+	{
+		std::lock_guard< std::mutex > guard( deviceMutex );
+		for ( char c : text )
+			input.push_back( static_cast< unsigned char >( c ) );
+		waiter.swap( inputWaiter );
+	}
+	if ( waiter )
+		waiter();
+}
+
+std::string Bus::takeOutput()
+{
+	std::lock_guard< std::mutex > guard( deviceMutex );
+	std::string res;
+	res.swap( output );
+	return res;
+}
+
+bool Bus::waitInput( std::function< void() > waiter )
+{
+	std::lock_guard< std::mutex > guard( deviceMutex );
+	if ( !input.empty() )
+		return false;
+	inputWaiter = std::move( waiter );
+	return true;
+}
+
+Machine::Machine( Bus *shared )
+{
+	if ( shared == nullptr )
+	{
+		ownBus.reset( new Bus() );
+		shared = ownBus.get();
+	}
+	bus = shared;
+	readPage = bus->getReadPages();
+	writePage = bus->getWritePages();
+	coreId = bus->attachCore();
+	for ( int i = 0; i < PAGES; i++ )
+		codePage[ i ] = 0;
+	codeGeneration = 0;
+	flushPending = false;
+	cacheKey = 0;
+	blocksBuilt = 0;
+	hookMode = HookOff;
+	hookValidation = false;
+	checkpointInterval = 0;
+	checkpointLimit = 0;
+	checkpointLog = false;
+	heatInterval = heatCountdown = 1;
+	frameInterval = 0;
+	frameTag = 0;
+	clearDebug();
+	reset();
+}
+
+void Machine::reset()
+{
+	if ( ownBus )
+		ownBus->reset();
+	for ( int i = 0; i < 8; i++ )
+		reg[ i ] = 0;
+	// undefined and unimplemented opcodes store last ALU result
+	x = y = a = 0;
+	tmp = 0;
+	math.reset();
+	timer.reset();
+	cycles = 0;
+	retired = 0;
+	perf = PerfCounters{ 0, 0, 0, 0 };
+	perfLatch = 0;
+	if ( !profile.empty() )
+		setProfiling( true );
+	events = decltype( events )();
+	if ( frameInterval )
+		events.push( Event{ frameInterval, EVENT_DISPLAY, frameTag } );
+	irqVector = irqPending = irqMask = 0;
+	updateNextEvent();
+	if ( !blockAt.empty() )
+		flushBlocks();
+	checkpoints.clear();
+	nextCheckpoint = 0;
+	horizon = 0;
+	diskWriteEnd = 0;
+	if ( checkpointInterval )
+		portLog.startRecord();
+}
+
+void Machine::schedule( const Event &event )
+{
+	events.push( event );
+	updateNextEvent();
+}
+
+void Machine::raiseIrq( mWord lines )
+{
+	irqPending |= lines;
+	updateNextEvent();
+}
+
+void Machine::updateNextEvent()
+{
+	nextEvent = events.empty() ? UINT64_MAX : events.top().when;
+	// pending interrupt is polled every step until it is delivered or acknowledged
+	if ( irqPending & irqMask )
+		nextEvent = cycles;
+}
+
+void Machine::processEvents()
+{
+	while ( !events.empty() && (events.top().when <= cycles) )
+	{
+		Event event = events.top();
+		events.pop();
+		switch ( event.source )
+		{
+		case EVENT_TIMER:
+				if ( timer.fire( event ) )
+				{
+					irqPending |= IRQ_TIMER;
+					if ( timer.armed() )
+						events.push( timer.nextEvent() );
+				}
+				break;
+		case EVENT_DISPLAY:
+				if ( event.tag == frameTag )
+				{
+					bus->getDisplay().frame( *bus );
+					events.push( Event{ event.when + frameInterval, EVENT_DISPLAY, frameTag } );
+				}
+				break;
+		};
+	}
+	if ( (irqPending & irqMask) && getFlag( FLAG_IRQ_ENABLE ) )
+		interrupt();
+	updateNextEvent();
+}
+
+void Machine::interrupt()
+{
+	// same as pushes by indirect writes to SP
+	charge( --reg[ REG_SP ], cost.write, perf.writes );
+	setMem( reg[ REG_SP ], reg[ REG_PC ] );
+	charge( --reg[ REG_SP ], cost.write, perf.writes );
+	setMem( reg[ REG_SP ], reg[ REG_PSW ] );
+	setFlag( FLAG_IRQ_ENABLE, false );
+	reg[ REG_PC ] = irqVector;
+}
+
+void Machine::clearDebug()
+{
+	breakMap.reset();
+	readWatchMap.reset();
+	writeWatchMap.reset();
+	for ( int i = 0; i < PAGES; i++ )
+		updateTraps( i << PAGE_SHIFT );
+	debugArmed = false;
+	stopReason = StopNone;
+	stopAddr = 0;
+}
+
+void Machine::updateTraps( mWord addr )
+{
+	int page = addr >> PAGE_SHIFT;
+	bool ports = (page << PAGE_SHIFT) + (1 << PAGE_SHIFT) > PORT_START;
+	bool heatmap = !heatReads.empty();
+	readTrap[ page ] = ports || heatmap;
+	writeTrap[ page ] = ports || heatmap || codePage[ page ] || bus->getDisplay().covers( page );
+	for ( int i = page * 4; i < page * 4 + 4; i++ )
+	{
+		if ( testWord( readWatchMap, i ) )
+			readTrap[ page ] = 1;
+		if ( testWord( writeWatchMap, i ) || testWord( nativeMap, i ) )
+			writeTrap[ page ] = 1;
+	}
+	debugArmed = (portLog.getMode() == PortLog::Replay);
+	if ( !breakMap && !readWatchMap && !writeWatchMap && !hookMap )
+		return;
+	for ( int i = 0; i < 1024; i++ )
+	{
+		if ( testWord( breakMap, i ) || testWord( readWatchMap, i ) || testWord( writeWatchMap, i ) || testWord( hookMap, i ) )
+		{
+			debugArmed = true;
+			break;
+		}
+	}
+}
+
+bool Machine::replayPorts( const std::string &fileName )
+{
+	if ( !portLog.load( fileName ) )
+		return false;
+	checkpointLog = false;
+	portLog.startReplay();
+	updateTraps( 0 );
+	return true;
+}
+
+void Machine::setBreakpoint( mWord addr, bool enable )
+{
+	setBit( breakMap, addr, enable );
+	updateTraps( addr );
+}
+
+void Machine::setHook( mWord addr, Hook hook )
+{
+	setBit( hookMap, addr, bool( hook ) );
+	if ( hook )
+		hooks[ addr ] = hook;
+	else
+		hooks.erase( addr );
+	updateTraps( addr );
+}
+
+void Machine::store( mWord addr, mWord data )
+{
+	if ( (hookMode == HookCapture) && (addr >= PORT_START) )
+		hookPorts.emplace_back( addr, data );
+	else
+		setMem( addr, data );
+}
+
+// true if native routine was run instead of guest code
+bool Machine::callHook( mWord addr )
+{
+	if ( hookValidation )
+		return validateHook( addr );
+	if ( !hooks[ addr ]( *this ) )
+		return false;
+	// whole call counts as one instruction
+	cycles += cost.opcode;
+	retired++;
+	if ( cycles >= nextEvent )
+		processEvents();
+	return true;
+}
+
+// native routine runs first and is undone, then guest routine runs until it pops its return address
+bool Machine::validateHook( mWord addr )
+{
+	mWord saved[ 8 ], native[ 8 ];
+	std::copy( reg, reg + 8, saved );
+	std::vector< mWord > before( PORT_START ), after( PORT_START );
+	for ( int i = 0; i < PORT_START; i++ )
+		before[ i ] = peek( i );
+	hookMode = HookCapture;
+	hookPorts.clear();
+	bool handled = hooks[ addr ]( *this );
+	hookMode = HookOff;
+	std::copy( reg, reg + 8, native );
+	std::copy( saved, saved + 8, reg );
+	for ( int i = 0; i < PORT_START; i++ )
+	{
+		after[ i ] = peek( i );
+		if ( after[ i ] != before[ i ] )
+			poke( i, before[ i ] );
+	}
+	if ( !handled )
+		return false;
+	std::vector< std::pair< mWord, mWord > > nativePorts;
+	nativePorts.swap( hookPorts );
+
+	mWord sp = reg[ REG_SP ];
+	mWord ret = peek( sp );
+	mWord minSp = sp;
+	hookMode = HookRecord;
+	for ( uint64_t n = 0; n < MAX_HOOK_STEPS; n++ )
+	{
+		if ( ((reg[ REG_SP ] == mWord( sp + 1 )) && (reg[ REG_PC ] == ret)) || (currentOp() == 0) )
+			break;
+		step();
+		minSp = std::min( minSp, reg[ REG_SP ] );
+		if ( stopReason != StopNone )
+			break;
+	}
+	hookMode = HookOff;
+	if ( stopReason != StopNone )
+		return true;	// e.g. input wait inside routine
+
+	std::stringstream ss;
+	ss << std::uppercase << std::hex << std::setfill( '0' );
+	if ( (reg[ REG_SP ] != mWord( sp + 1 )) || (reg[ REG_PC ] != ret) )
+		ss << "guest routine did not return";
+	for ( int r = 0; (r < 8) && ss.str().empty(); r++ )
+	{
+		if ( native[ r ] != reg[ r ] )
+			ss << "R" << r << " native $" << std::setw( 4 ) << native[ r ] << " != guest $" << std::setw( 4 ) << reg[ r ];
+	}
+	// stack words below return address are scratch of guest routine
+	for ( int i = 0; (i < PORT_START) && ss.str().empty(); i++ )
+	{
+		if ( (after[ i ] != peek( i )) && !((i >= minSp) && (i < sp)) )
+			ss << "[ $" << std::setw( 4 ) << i << " ] native $" << std::setw( 4 ) << after[ i ] << " != guest $" << std::setw( 4 ) << peek( i );
+	}
+	if ( ss.str().empty() && (nativePorts != hookPorts) )
+		ss << "port writes native " << std::dec << nativePorts.size() << " != guest " << hookPorts.size();
+	if ( !ss.str().empty() )
+	{
+		hookDiff = ss.str();
+		hit( StopHook, addr );
+	}
+	return true;
+}
+
+void Machine::setWatchpoint( mWord addr, bool onRead, bool onWrite )
+{
+	setBit( readWatchMap, addr, onRead );
+	setBit( writeWatchMap, addr, onWrite );
+	updateTraps( addr );
+}
+
+mWord Machine::getMem( mWord addr )
+{
+	if ( !readTrap[ addr >> PAGE_SHIFT ] )
+		return peek( addr );
+	return getMemSlow( addr );
+}
 
 void Machine::setMem( mWord addr, mWord data )
 {
+	if ( !writeTrap[ addr >> PAGE_SHIFT ] )
+		poke( addr, data );
+	else
+		setMemSlow( addr, data );
+}
+
+mWord Machine::getMemSlow( mWord addr )
+{
+	if ( !heatReads.empty() )
+		heat( heatReads, addr );
+	if ( addr < PORT_START )
+	{
+		if ( testBit( readWatchMap, addr ) )
+			hit( StopReadWatch, addr );
+		return peek( addr );
+	}
+	if ( portLog.getMode() == PortLog::Off )
+		return readPort( addr );
+	mWord value;
+	if ( portLog.getMode() == PortLog::Replay )
+	{
+		if ( portLog.replay( retired, addr, value ) )
+			return value;
+		if ( portLog.resume() )
+		{
+			// rewound machine got past end of log
+			updateTraps( 0 );
+			value = readPort( addr );
+			portLog.record( retired, addr, value );
+			return value;
+		}
+		portLog.stop();	// out of sync, continue with live devices
+		updateTraps( 0 );
+		hit( StopReplay, addr );
+		return readPort( addr );
+	}
+	value = readPort( addr );
+	portLog.record( retired, addr, value );
+	return value;
+}
+
+mWord Machine::readPort( mWord addr )
+{
+	if ( (addr >= PORT_MATH_FIRST) && (addr <= PORT_MATH_LAST) )
+		return math.read( addr );
+	if ( (addr >= PORT_TIMER_FIRST) && (addr <= PORT_TIMER_LAST) )
+		return timer.read( addr, cycles );
+	if ( (addr >= PORT_PERF_FIRST) && (addr <= PORT_PERF_LAST) )
+		return readPerf( addr );
+	switch ( addr )
+	{
+	case PORT_IRQ_VECTOR:	return irqVector;
+	case PORT_IRQ_PENDING:	return irqPending;
+	case PORT_IRQ_MASK:	return irqMask;
+	case PORT_CORE_ID:	return coreId;
+	case PORT_CORE_COUNT:	return bus->getCores();
+	};
+	mWord value = bus->readPort( addr );
+	if ( (addr == PORT_CONSOLE) && bus->takeStarved() )
+		hit( StopInputWait, addr );
+	return value;
+};
+
+mWord Machine::readPerf( mWord addr )
+{
+	if ( addr & 1 )
+		return perfLatch;
+	uint64_t value = 0;
+	switch ( addr )
+	{
+	case PORT_PERF_RETIRED_LO:	value = retired; break;
+	case PORT_PERF_READS_LO:	value = perf.reads; break;
+	case PORT_PERF_WRITES_LO:	value = perf.writes; break;
+	case PORT_PERF_BRANCHES_LO:	value = perf.branches; break;
+	case PORT_PERF_PORTS_LO:	value = perf.ports; break;
+	};
+	perfLatch = (value >> 16) & 0xFFFF;
+	return value & 0xFFFF;
+}
+
+void Machine::setMemSlow( mWord addr, mWord data )
+{
+	if ( !heatWrites.empty() )
+		heat( heatWrites, addr );
 	if ( addr < PORT_START )
 	{
-		mem[ addr ] = data;
+		if ( testBit( writeWatchMap, addr ) )
+			hit( StopWriteWatch, addr );
+		if ( testBit( codeMap, addr ) && (peek( addr ) != data) )
+			flushBlocks();
+		if ( testBit( nativeMap, addr ) && (peek( addr ) != data) )
+			nativeWrites.push_back( addr );
+		bus->getDisplay().mark( addr );
+		poke( addr, data );
 	}
 	else
 	{
-		if ( addr == PORT_CONSOLE )
+		if ( (addr >= PORT_MATH_FIRST) && (addr <= PORT_MATH_LAST) )
 		{
-			std::cout << static_cast< char >( data );
+			math.write( addr, data );
+		}
+		else if ( (addr >= PORT_TIMER_FIRST) && (addr <= PORT_TIMER_LAST) )
+		{
+			if ( timer.write( addr, data, cycles ) )
+				schedule( timer.nextEvent() );
+		}
+		else if ( addr == PORT_IRQ_VECTOR )
+		{
+			irqVector = data;
+		}
+		else if ( addr == PORT_IRQ_PENDING )
+		{
+			irqPending &= ~data;
+			updateNextEvent();
+		}
+		else if ( addr == PORT_IRQ_MASK )
+		{
+			irqMask = data;
+			updateNextEvent();
+		}
+		else if ( addr == PORT_IRQ_WAIT )
+		{
+			// sleep: skip idle cycles up to next timed event
+			if ( !events.empty() && (events.top().when > cycles) )
+				cycles = events.top().when;
+			updateNextEvent();
+		}
+		else
+		{
+			if ( hookMode == HookRecord )
+				hookPorts.emplace_back( addr, data );
+			if ( (addr == PORT_CONSOLE) && (retired < horizon) )
+				return;	// printed before rewind
+			// disk contents seen by checkpoints taken before are gone
+			if ( (addr == PORT_DISK_CMD) && (data == DISK_WRITE) )
+				diskWriteEnd = std::max( diskWriteEnd, retired + 1 );
+			mWord lines = bus->writePort( addr, data );
+			if ( lines )
+				raiseIrq( lines );
+			// memory is remapped or filled by transfer
+			if ( ((addr >= PORT_MMU_FIRST) && (addr <= PORT_MMU_LAST)) || (addr == PORT_DISK_CMD) )
+			{
+				if ( !blockAt.empty() )
+					flushBlocks();
+				bus->getDisplay().markAll();
+			}
 		}
 	}
 };
@@ -135,6 +876,7 @@ mWord Machine::read( mTag r, mTag i )
 			addr = reg[ r ];
 		if ( (r == REG_PC) || (r == REG_SP) )
 			reg[ r ]++;
+		charge( addr, (r == REG_PC) ? cost.immediate : cost.read, perf.reads );
 		//std::cout << "addr:" << addr << " read:" << getMem( addr ) << "\n";
 		return getMem( addr );
 	}
@@ -147,9 +889,18 @@ mWord Machine::read( mTag r, mTag i )
 
 void Machine::step()
 {
-	mWord cond;
+	mWord pc = reg[ REG_PC ];
+	uint64_t start = cycles;
 	// fetch & decode instruction
-	instr.decode( fetch() );
+	cycles += cost.opcode;
+	instr.decode( getMem( reg[ REG_PC ]++ ) );
+	execute( pc, start );
+}
+
+// decoded instr at pc, start is cycle count before its fetch
+void Machine::execute( mWord pc, uint64_t start )
+{
+	mWord cond;
 
 	// read x
 	if ( instr.isInplaceImmediate( instr.cmd ) )
@@ -217,6 +968,7 @@ void Machine::step()
 				((cond == COND_NSIGN) && (!getFlag( FLAG_SIGN ))) )
 			{
 				a = y + x;
+				perf.branches++;
 				//std::cout << "COND:" << a << "\n";
 			}
 			else
@@ -243,6 +995,7 @@ void Machine::step()
 			else
 				addr = reg[ instr.r ];
 			//std::cout << "addr:" << addr << " writ:" << a << "\n";
+			charge( addr, cost.write, perf.writes );
 			setMem( addr, a );
 		}
 	}
@@ -250,9 +1003,491 @@ void Machine::step()
 	{
 		reg[ instr.r ] = a;
 	}
+
+	retired++;
+	if ( !profile.empty() )
+	{
+		profile[ pc ].cycles += cycles - start;
+		profile[ pc ].count++;
+	}
+	if ( cycles >= nextEvent )
+		processEvents();
 };
 
-void Machine::show()
+Machine::StopReason Machine::run( uint64_t maxSteps, bool resume )
+{
+	stopReason = StopNone;
+	if ( checkpointInterval == 0 )
+		return runSteps( maxSteps, resume );
+	// checkpoints are taken between runs of steps
+	for ( bool first = resume; ; first = false )
+	{
+		if ( retired >= nextCheckpoint )
+			takeCheckpoint();
+		uint64_t start = retired;
+		StopReason reason = runSteps( std::min( maxSteps, nextCheckpoint - retired ), first );
+		maxSteps -= std::min( maxSteps, retired - start );
+		horizon = std::max( horizon, retired );
+		if ( (reason != StopLimit) || (maxSteps == 0) )
+			return reason;
+	}
+}
+
+// first step passes breakpoint at PC
+Machine::StopReason Machine::runSteps( uint64_t maxSteps, bool first )
+{
+	if ( !debugArmed )
+	{
+		if ( !blockAt.empty() )
+			return runBlocks( maxSteps );
+		for ( uint64_t n = 0; n < maxSteps; n++ )
+		{
+			if ( currentOp() == 0 )
+				return stopReason = StopHalt;
+			step();
+			if ( stopReason != StopNone )
+				return stopReason;	// device asked to stop, e.g. input wait
+		}
+		return stopReason = StopLimit;
+	}
+	for ( uint64_t n = 0; n < maxSteps; n++ )
+	{
+		if ( currentOp() == 0 )
+			return stopReason = StopHalt;
+		if ( ((n > 0) || !first) && testBit( breakMap, reg[ REG_PC ] ) )
+		{
+			hit( StopBreakpoint, reg[ REG_PC ] );
+			return stopReason;
+		}
+		if ( testBit( hookMap, reg[ REG_PC ] ) && callHook( reg[ REG_PC ] ) )
+		{
+			if ( stopReason != StopNone )
+				return stopReason;
+			continue;
+		}
+		step();
+		if ( stopReason != StopNone )
+			return stopReason;	// watchpoint or device
+	}
+	return stopReason = StopLimit;
+}
+
+// words of instruction with its immediates
+static int opLength( const Instruction &in )
+{
+	int len = 1;
+	if ( !Instruction::isInplaceImmediate( in.cmd ) && in.xi && ((in.x == REG_PC) || (in.x == REG_PSW)) )
+		len++;
+	if ( in.yi && ((in.y == REG_PC) || (in.y == REG_PSW)) )
+		len++;
+	if ( in.ri && (in.r == REG_PSW) )
+		len++;
+	return len;
+}
+
+int Machine::buildBlock( mWord start )
+{
+	Block block{ start, {} };
+	mWord addr = start;
+	while ( block.ops.size() < MAX_BLOCK_OPS )
+	{
+		DecodedOp op;
+		op.word = peek( addr );
+		op.instr.decode( op.word );
+		op.next = addr + opLength( op.instr );
+		block.ops.push_back( op );
+		// jump ends block, halt and code in I/O page are left to run loop
+		if ( (!op.instr.ri && (op.instr.r == REG_PC)) || (op.next < addr) || (op.next >= PORT_START) || (peek( op.next ) == 0) )
+			break;
+		addr = op.next;
+	}
+	blocksBuilt++;
+	return addBlock( std::move( block ) );
+}
+
+int Machine::addBlock( Block &&block )
+{
+	mWord addr = block.start;
+	for ( auto &op : block.ops )
+	{
+		setBit( codeMap, addr, true );
+		if ( !codePage[ addr >> PAGE_SHIFT ] )
+		{
+			codePage[ addr >> PAGE_SHIFT ] = 1;
+			updateTraps( addr );
+		}
+		addr = op.next;
+	}
+	int index = blocks.size();
+	blockAt[ block.start ] = index;
+	blocks.push_back( std::move( block ) );
+	return index;
+}
+
+void Machine::flushBlocks()
+{
+	codeGeneration++;
+	flushPending = true;
+	if ( codeMap )
+		std::fill( codeMap.get(), codeMap.get() + 1024, 0 );
+	for ( int i = 0; i < PAGES; i++ )
+	{
+		if ( codePage[ i ] )
+		{
+			codePage[ i ] = 0;
+			updateTraps( i << PAGE_SHIFT );
+		}
+	}
+}
+
+void Machine::setBlockEngine( bool enable )
+{
+	flushBlocks();
+	blocks.clear();
+	flushPending = false;
+	blockAt.assign( enable ? 65536 : 0, -1 );
+	blocksBuilt = 0;
+}
+
+// same as fast loop of run(), opcodes come from blocks instead of memory
+Machine::StopReason Machine::runBlocks( uint64_t maxSteps )
+{
+	uint64_t n = 0;
+	while ( n < maxSteps )
+	{
+		if ( flushPending )
+		{
+			for ( auto &b : blocks )
+				blockAt[ b.start ] = -1;
+			blocks.clear();
+			flushPending = false;
+		}
+		mWord pc = reg[ REG_PC ];
+		if ( peek( pc ) == 0 )
+			return stopReason = StopHalt;
+		if ( pc >= PORT_START )
+		{
+			step();
+			n++;
+			if ( stopReason != StopNone )
+				return stopReason;
+			continue;
+		}
+		int index = blockAt[ pc ];
+		if ( index < 0 )
+			index = buildBlock( pc );
+		const Block &block = blocks[ index ];
+		uint64_t generation = codeGeneration;
+		for ( const DecodedOp &op : block.ops )
+		{
+			uint64_t start = cycles;
+			cycles += cost.opcode;
+			reg[ REG_PC ]++;
+			instr = op.instr;
+			execute( pc, start );
+			n++;
+			if ( stopReason != StopNone )
+				return stopReason;	// device asked to stop, e.g. input wait
+			// jump, interrupt or store to code
+			if ( (reg[ REG_PC ] != op.next) || (generation != codeGeneration) || (n >= maxSteps) )
+				break;
+			pc = op.next;
+		}
+	}
+	return stopReason = StopLimit;
+}
+
+uint64_t Machine::imageHash()
+{
+	// FNV-1a
+	uint64_t hash = 0xCBF29CE484222325ull ^ BLOCK_CACHE_VERSION;
+	for ( int addr = 0; addr < PORT_START; addr++ )
+	{
+		mWord w = peek( addr );
+		hash = (hash ^ (w & 0xFF)) * 0x100000001B3ull;
+		hash = (hash ^ (w >> 8)) * 0x100000001B3ull;
+	}
+	return hash;
+}
+
+// cache file: magic, version, 4 words of key, then blocks as start, op count and opcode words
+bool Machine::loadBlocks( const std::string &dir )
+{
+	setBlockEngine( true );
+	cacheKey = imageHash();
+	std::stringstream ss;
+	ss << dir << "/" << std::hex << std::setw( 16 ) << std::setfill( '0' ) << cacheKey << ".blk";
+	cacheFile = ss.str();
+
+	std::ifstream ifs( cacheFile, std::ios::binary );
+	if ( ifs.fail() )
+		return false;
+	std::vector< char > bytes( (std::istreambuf_iterator< char >( ifs )), std::istreambuf_iterator< char >() );
+	std::vector< mWord > data( bytes.size() / sizeof( mWord ) );
+	memcpy( data.data(), bytes.data(), data.size() * sizeof( mWord ) );
+	if ( (data.size() < 6) || (data[ 0 ] != BLOCK_CACHE_MAGIC) || (data[ 1 ] != BLOCK_CACHE_VERSION) )
+		return false;
+	for ( int i = 0; i < 4; i++ )
+	{
+		if ( data[ 2 + i ] != mWord( cacheKey >> (i * 16) ) )
+			return false;
+	}
+	for ( size_t i = 6; i + 2 <= data.size(); )
+	{
+		Block block{ data[ i ], {} };
+		size_t count = data[ i + 1 ];
+		i += 2;
+		if ( (count == 0) || (count > MAX_BLOCK_OPS) || (i + count > data.size()) )
+			return false;
+		// every opcode must still be in memory where block expects it
+		bool valid = true;
+		mWord addr = block.start;
+		for ( size_t k = 0; k < count; k++ )
+		{
+			DecodedOp op;
+			op.word = data[ i + k ];
+			op.instr.decode( op.word );
+			op.next = addr + opLength( op.instr );
+			if ( (addr >= PORT_START) || (op.word == 0) || (peek( addr ) != op.word) )
+				valid = false;
+			block.ops.push_back( op );
+			addr = op.next;
+		}
+		i += count;
+		if ( valid )
+			addBlock( std::move( block ) );
+	}
+	return true;
+}
+
+bool Machine::saveBlocks()
+{
+	if ( cacheFile.empty() )
+		return false;
+	std::vector< mWord > data = { BLOCK_CACHE_MAGIC, BLOCK_CACHE_VERSION };
+	for ( int i = 0; i < 4; i++ )
+		data.push_back( mWord( cacheKey >> (i * 16) ) );
+	if ( !flushPending )
+	{
+		for ( auto &b : blocks )
+		{
+			data.push_back( b.start );
+			data.push_back( mWord( b.ops.size() ) );
+			for ( auto &op : b.ops )
+				data.push_back( op.word );
+		}
+	}
+	std::ofstream ofs( cacheFile, std::ios::binary );
+	ofs.write( reinterpret_cast< const char * >( data.data() ), data.size() * sizeof( mWord ) );
+	return !ofs.fail();
+}
+
+void Machine::setFrameInterval( uint64_t interval )
+{
+	frameInterval = interval;
+	frameTag++;
+	for ( int i = 0; i < PAGES; i++ )
+		updateTraps( i << PAGE_SHIFT );
+	if ( interval )
+		schedule( Event{ cycles + interval, EVENT_DISPLAY, frameTag } );
+}
+
+void Machine::setHeatmap( bool enable, uint32_t interval )
+{
+	heatReads.assign( enable ? 65536 : 0, 0 );
+	heatWrites.assign( enable ? 65536 : 0, 0 );
+	heatInterval = heatCountdown = std::max( interval, 1u );
+	for ( int i = 0; i < PAGES; i++ )
+		updateTraps( i << PAGE_SHIFT );
+}
+
+bool Machine::saveHeatmap( const std::string &fileName, const std::vector< Symbol > &symbols, bool csv )
+{
+	if ( heatReads.empty() )
+		return false;
+	if ( !csv )
+	{
+		std::ofstream ofs( fileName, std::ios::binary );
+		ofs.write( reinterpret_cast< const char * >( heatReads.data() ), heatReads.size() * sizeof( uint64_t ) );
+		ofs.write( reinterpret_cast< const char * >( heatWrites.data() ), heatWrites.size() * sizeof( uint64_t ) );
+		return !ofs.fail();
+	}
+	// symbols are sorted by address, range of symbol ends at next one
+	std::vector< uint64_t > pageReads( PAGES, 0 ), pageWrites( PAGES, 0 );
+	std::vector< uint64_t > symReads( symbols.size() + 1, 0 ), symWrites( symbols.size() + 1, 0 );
+	for ( int addr = 0; addr < 65536; addr++ )
+	{
+		if ( !heatReads[ addr ] && !heatWrites[ addr ] )
+			continue;
+		pageReads[ addr >> PAGE_SHIFT ] += heatReads[ addr ];
+		pageWrites[ addr >> PAGE_SHIFT ] += heatWrites[ addr ];
+		auto it = std::upper_bound( symbols.begin(), symbols.end(), addr,
+				[]( int a, const Symbol &s ) { return a < s.addr; } );
+		symReads[ it - symbols.begin() ] += heatReads[ addr ];
+		symWrites[ it - symbols.begin() ] += heatWrites[ addr ];
+	}
+	std::ofstream ofs( fileName );
+	ofs << std::uppercase << std::hex << std::setfill( '0' );
+	ofs << "page,reads,writes\n";
+	for ( int p = 0; p < PAGES; p++ )
+	{
+		if ( pageReads[ p ] || pageWrites[ p ] )
+			ofs << "$" << std::setw( 4 ) << (p << PAGE_SHIFT) << "," << std::dec << pageReads[ p ] << "," << pageWrites[ p ] << std::hex << "\n";
+	}
+	ofs << "\nsymbol,start,end,reads,writes\n";
+	for ( size_t i = 0; i <= symbols.size(); i++ )
+	{
+		if ( !symReads[ i ] && !symWrites[ i ] )
+			continue;
+		mWord start = (i == 0) ? 0 : symbols[ i - 1 ].addr;
+		mWord end = (i == symbols.size()) ? 0xFFFF : mWord( symbols[ i ].addr - 1 );
+		ofs << ((i == 0) ? "<start>" : symbols[ i - 1 ].name) << ",$" << std::setw( 4 ) << start << ",$" << std::setw( 4 ) << end;
+		ofs << "," << std::dec << symReads[ i ] << "," << symWrites[ i ] << std::hex << "\n";
+	}
+	return !ofs.fail();
+}
+
+// pages of a held by it only, when b is the next state
+static size_t differentPages( const std::vector< PagePtr > &a, const std::vector< PagePtr > &b )
+{
+	size_t count = 0;
+	for ( size_t i = 0; i < a.size(); i++ )
+	{
+		if ( (a[ i ] != zeroPage) && ((i >= b.size()) || (a[ i ] != b[ i ])) )
+			count++;
+	}
+	return count;
+}
+
+void Machine::setCheckpoints( uint64_t interval, size_t limitKB )
+{
+	checkpointInterval = interval;
+	checkpointLimit = limitKB;
+	checkpoints.clear();
+	nextCheckpoint = retired;
+	horizon = retired;
+	if ( interval && (portLog.getMode() == PortLog::Off) )
+	{
+		checkpointLog = true;
+		portLog.startRecord();
+	}
+}
+
+void Machine::takeCheckpoint()
+{
+	Checkpoint cp;
+	cp.retired = retired;
+	cp.cycles = cycles;
+	std::copy( reg, reg + 8, cp.reg );
+	cp.x = x;
+	cp.y = y;
+	cp.a = a;
+	cp.tmp = tmp;
+	cp.math = math;
+	cp.timer = timer;
+	cp.perf = perf;
+	cp.perfLatch = perfLatch;
+	cp.events = events;
+	cp.irqVector = irqVector;
+	cp.irqPending = irqPending;
+	cp.irqMask = irqMask;
+	cp.bus = bus->snapshot();
+	cp.log = portLog.tell();
+	cp.pages = 0;
+	if ( !checkpoints.empty() )
+		checkpoints.back().pages = differentPages( checkpoints.back().bus.phys, cp.bus.phys );
+	checkpoints.push_back( std::move( cp ) );
+	nextCheckpoint = retired + checkpointInterval;
+	thinCheckpoints();
+}
+
+// Pages and port log after first checkpoint are kept under limit. While pages take more,
+// every second checkpoint but first and last is dropped and interval doubles, otherwise
+// first checkpoint is dropped and log before next one is trimmed.
+void Machine::thinCheckpoints()
+{
+	while ( checkpoints.size() > 1 )
+	{
+		size_t pages = 0;
+		for ( auto &cp : checkpoints )
+			pages += cp.pages;
+		size_t pageBytes = pages * sizeof( Page );
+		size_t logBytes = portLog.size() - checkpoints.front().log.pos;
+		if ( (pageBytes + logBytes) / 1024 <= checkpointLimit )
+			break;
+		if ( (pageBytes < logBytes) || (checkpoints.size() == 2) )
+		{
+			if ( !checkpointLog )
+				break;	// log of record or replay is kept whole
+			checkpoints.pop_front();
+			size_t bytes = checkpoints.front().log.pos;
+			portLog.trim( bytes );
+			for ( auto &cp : checkpoints )
+				cp.log.pos -= bytes;
+			continue;
+		}
+		std::deque< Checkpoint > kept;
+		for ( size_t i = 0; i < checkpoints.size(); i++ )
+		{
+			if ( (i % 2 == 0) || (i + 1 == checkpoints.size()) )
+				kept.push_back( std::move( checkpoints[ i ] ) );
+		}
+		checkpoints.swap( kept );
+		for ( size_t i = 0; i + 1 < checkpoints.size(); i++ )
+			checkpoints[ i ].pages = differentPages( checkpoints[ i ].bus.phys, checkpoints[ i + 1 ].bus.phys );
+		checkpointInterval *= 2;
+		nextCheckpoint = checkpoints.back().retired + checkpointInterval;
+	}
+}
+
+void Machine::restoreCheckpoint( const Checkpoint &cp )
+{
+	retired = cp.retired;
+	cycles = cp.cycles;
+	std::copy( cp.reg, cp.reg + 8, reg );
+	x = cp.x;
+	y = cp.y;
+	a = cp.a;
+	tmp = cp.tmp;
+	math = cp.math;
+	timer = cp.timer;
+	perf = cp.perf;
+	perfLatch = cp.perfLatch;
+	events = cp.events;
+	irqVector = cp.irqVector;
+	irqPending = cp.irqPending;
+	irqMask = cp.irqMask;
+	bus->restore( cp.bus );
+	portLog.seek( cp.log );
+	updateTraps( 0 );
+	updateNextEvent();
+	if ( !blockAt.empty() )
+		flushBlocks();
+}
+
+bool Machine::rewind( uint64_t target )
+{
+	horizon = std::max( horizon, retired );
+	auto cp = std::upper_bound( checkpoints.begin(), checkpoints.end(), target,
+		[]( uint64_t t, const Checkpoint &c ) { return t < c.retired; } );
+	if ( cp == checkpoints.begin() )
+		return false;
+	if ( (--cp)->retired < diskWriteEnd )
+		return false;	// disk was written since, reads would get new contents
+	restoreCheckpoint( *cp );
+	// breakpoints and watchpoints do not stop re-execution
+	while ( retired < target )
+	{
+		stopReason = StopNone;
+		StopReason reason = runSteps( target - retired, true );
+		if ( (reason == StopHalt) || (reason == StopReplay) || (reason == StopInputWait) )
+			break;
+	}
+	stopReason = StopNone;
+	return retired == target;
+}
+
+void Machine::show( bool memory )
 {
 	for ( int i = 0; i < 8; i++ )
 	{
@@ -269,6 +1504,8 @@ void Machine::show()
 			std::cout << "  ";
 	};
 	std::cout << "\n";
+	if ( !memory )
+		return;
 	mWord start = 0;
 	int cols = 8;
 	int rows = 16;
@@ -280,10 +1517,36 @@ void Machine::show()
 				std::cout << "  ";
 			mWord cell = start + y + x * rows;
 			std::cout << std::hex << std::setw( 4 ) << std::setfill( '0' ) << cell  << ":";
-			std::cout << std::hex << std::setw( 4 ) << std::setfill( '0' ) << mem[ cell ];
+			std::cout << std::hex << std::setw( 4 ) << std::setfill( '0' ) << peek( cell );
 		};
 		std::cout << "\n";
 	};
 }
 
+void Machine::showProfile( const std::vector< Symbol > &symbols )
+{
+	// symbols are sorted by address, code before first symbol goes to '<start>'
+	std::vector< ProfileEntry > routines( symbols.size() + 1, ProfileEntry{ 0, 0 } );
+	for ( size_t addr = 0; addr < profile.size(); addr++ )
+	{
+		if ( profile[ addr ].count == 0 )
+			continue;
+		auto it = std::upper_bound( symbols.begin(), symbols.end(), addr,
+				[]( int a, const Symbol &s ) { return a < s.addr; } );
+		ProfileEntry &r = routines[ it - symbols.begin() ];
+		r.cycles += profile[ addr ].cycles;
+		r.count += profile[ addr ].count;
+	}
+	std::cout << std::dec << std::setfill( ' ' );
+	for ( size_t i = 0; i < routines.size(); i++ )
+	{
+		if ( routines[ i ].count == 0 )
+			continue;
+		std::cout << std::left << std::setw( 24 ) << ((i == 0) ? "<start>" : symbols[ i - 1 ].name) << std::right;
+		std::cout << " cycles: " << std::setw( 12 ) << routines[ i ].cycles;
+		std::cout << " instructions: " << std::setw( 12 ) << routines[ i ].count;
+		std::cout << " (" << std::fixed << std::setprecision( 2 ) << double( routines[ i ].cycles ) / routines[ i ].count << " per instruction)\n";
+	}
+}
+
 }	// namespace Simpleton
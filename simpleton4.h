@@ -7,6 +7,12 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <queue>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <deque>
+#include <functional>
 
 namespace Simpleton
 {
@@ -70,8 +76,126 @@ const int OP_CADD	=	0x0A;
 const int OP_RRCI	=	0x0B;
 const int OP_RRC	=	0x0C;
 
+// I/O page: every address from PORT_START and up is a device port
+const int PORT_START	=	0xFF00;
 const int PORT_CONSOLE	=	0xFFFF;
-const int PORT_START	=	0xFFFF;
+
+// math coprocessor
+const int PORT_MATH_X_LO	=	0xFFF0;	// operand: multiplicand or low word of dividend
+const int PORT_MATH_X_HI	=	0xFFF1;	// operand: high word of dividend
+const int PORT_MATH_Y		=	0xFFF2;	// operand: multiplier or divisor
+const int PORT_MATH_CMD		=	0xFFF3;	// write: command, read: status
+const int PORT_MATH_RES_LO	=	0xFFF4;	// result: low word of product or quotient
+const int PORT_MATH_RES_HI	=	0xFFF5;	// result: high word of product or quotient
+const int PORT_MATH_REM		=	0xFFF6;	// result: remainder
+const int PORT_MATH_FIRST	=	PORT_MATH_X_LO;
+const int PORT_MATH_LAST	=	PORT_MATH_REM;
+
+const int MATH_MUL	=	1;	// X_LO * Y -> RES_HI:RES_LO (unsigned)
+const int MATH_IMUL	=	2;	// X_LO * Y -> RES_HI:RES_LO (signed)
+const int MATH_DIV	=	3;	// X_HI:X_LO / Y -> RES_HI:RES_LO, REM (unsigned)
+const int MATH_IDIV	=	4;	// X_HI:X_LO / Y -> RES_HI:RES_LO, REM (signed)
+
+const int MATH_STATUS_DIV_ZERO	=	0x0001;
+const int MATH_STATUS_OVERFLOW	=	0x0002;
+const int MATH_STATUS_BAD_CMD	=	0x0004;
+
+// block storage
+const int PORT_DISK_SECTOR_LO	=	0xFFE0;	// first sector of transfer
+const int PORT_DISK_SECTOR_HI	=	0xFFE1;
+const int PORT_DISK_ADDR	=	0xFFE2;	// memory address of transfer
+const int PORT_DISK_COUNT	=	0xFFE3;	// sectors to transfer
+const int PORT_DISK_CMD		=	0xFFE4;	// write: command, read: status
+const int PORT_DISK_SIZE_LO	=	0xFFE5;	// read-only: sectors in image
+const int PORT_DISK_SIZE_HI	=	0xFFE6;
+const int PORT_DISK_FIRST	=	PORT_DISK_SECTOR_LO;
+const int PORT_DISK_LAST	=	PORT_DISK_SIZE_HI;
+
+const int DISK_SECTOR_WORDS	=	256;
+
+const int DISK_READ	=	1;	// image -> memory
+const int DISK_WRITE	=	2;	// memory -> image
+
+const int DISK_STATUS_DONE	=	0x0001;
+const int DISK_STATUS_ERROR	=	0x0002;
+const int DISK_STATUS_NO_MEDIA	=	0x0004;
+
+// framebuffer: DISPLAY_WIDTH x DISPLAY_HEIGHT RGB565 words of RAM row by row, no ports
+const int DISPLAY_WIDTH		=	128;
+const int DISPLAY_HEIGHT	=	128;
+const int DISPLAY_TILE		=	16;	// dirty tracking unit, all tiles fit one 64-bit mask
+const int DISPLAY_TILES_X	=	DISPLAY_WIDTH / DISPLAY_TILE;
+const int DISPLAY_PIXELS	=	DISPLAY_WIDTH * DISPLAY_HEIGHT;
+const int DISPLAY_BASE		=	0x8000;	// default address
+
+// interrupt controller
+const int PORT_IRQ_VECTOR	=	0xFFD0;	// handler address
+const int PORT_IRQ_PENDING	=	0xFFD1;	// read: pending lines, write: acknowledge lines set to 1
+const int PORT_IRQ_MASK		=	0xFFD2;	// lines allowed to interrupt
+const int PORT_IRQ_WAIT		=	0xFFD3;	// write: sleep until next timed event
+const int PORT_IRQ_FIRST	=	PORT_IRQ_VECTOR;
+const int PORT_IRQ_LAST		=	PORT_IRQ_WAIT;
+
+const int IRQ_TIMER	=	0x0001;
+const int IRQ_DISK	=	0x0002;
+
+// programmable timer
+const int PORT_TIMER_PERIOD	=	0xFFD8;	// ticks between interrupts
+const int PORT_TIMER_CTRL	=	0xFFD9;	// see TIMER_* bits
+const int PORT_TIMER_COUNT	=	0xFFDA;	// read-only: ticks left
+const int PORT_TIMER_FIRST	=	PORT_TIMER_PERIOD;
+const int PORT_TIMER_LAST	=	PORT_TIMER_COUNT;
+
+const int TIMER_ENABLE		=	0x0001;
+const int TIMER_ONE_SHOT	=	0x0002;
+const int TIMER_PRESCALE_SHIFT	=	8;	// bits 8-11: tick is (1 << prescale) cycles
+
+const int EVENT_TIMER	=	0;
+const int EVENT_DISPLAY	=	1;
+
+// memory management unit: 16 banks of 4K words mapped onto physical frames
+const int PORT_MMU_BANK		=	0xFFC0;	// bank selected for PORT_MMU_FRAME
+const int PORT_MMU_FRAME	=	0xFFC1;	// physical frame of selected bank
+const int PORT_MMU_CTRL		=	0xFFC2;	// bit 0: mapping enabled
+const int PORT_MMU_FRAMES	=	0xFFC3;	// read-only: physical frames available
+const int PORT_MMU_FIRST	=	PORT_MMU_BANK;
+const int PORT_MMU_LAST		=	PORT_MMU_FRAMES;
+
+const int MMU_BANKS		=	16;
+const int MMU_BANK_SHIFT	=	12;
+const int MMU_BANK_WORDS	=	1 << MMU_BANK_SHIFT;
+const int MMU_FRAMES		=	1024;	// 4M words, first 16 frames are base memory
+
+// multiprocessor
+const int PORT_LOCK_FIRST	=	0xFFB0;	// read: test-and-set (0 - lock taken), write: store (0 - release)
+const int PORT_LOCK_LAST	=	0xFFB7;
+const int PORT_CORE_ID		=	0xFFB8;	// read-only: index of reading core
+const int PORT_CORE_COUNT	=	0xFFB9;	// read-only: cores on bus
+
+const int BUS_LOCKS		=	PORT_LOCK_LAST - PORT_LOCK_FIRST + 1;
+
+// read-only performance counters of core, 32 bits each: reading LO latches HI
+const int PORT_PERF_RETIRED_LO	=	0xFFA0;	// instructions retired
+const int PORT_PERF_RETIRED_HI	=	0xFFA1;
+const int PORT_PERF_READS_LO	=	0xFFA2;	// operand reads from RAM, immediates included
+const int PORT_PERF_READS_HI	=	0xFFA3;
+const int PORT_PERF_WRITES_LO	=	0xFFA4;	// writes to RAM
+const int PORT_PERF_WRITES_HI	=	0xFFA5;
+const int PORT_PERF_BRANCHES_LO	=	0xFFA6;	// cadd with true condition
+const int PORT_PERF_BRANCHES_HI	=	0xFFA7;
+const int PORT_PERF_PORTS_LO	=	0xFFA8;	// reads and writes of I/O page
+const int PORT_PERF_PORTS_HI	=	0xFFA9;
+const int PORT_PERF_FIRST	=	PORT_PERF_RETIRED_LO;
+const int PORT_PERF_LAST	=	PORT_PERF_PORTS_HI;
+
+// memory is kept in pages, which are also units of copy-on-write and of access traps
+const int PAGE_SHIFT	=	8;
+const int PAGE_WORDS	=	1 << PAGE_SHIFT;
+const int PAGES		=	65536 >> PAGE_SHIFT;
+const int BANK_PAGES	=	MMU_BANK_WORDS / PAGE_WORDS;
+
+// buffer size for one line of Machine::disassemble()
+const int DISASM_TEXT	=	64;
 
 struct Instruction
 {
@@ -103,21 +227,506 @@ struct Instruction
 	static bool isInplaceImmediate( mTag cmd );
 };
 
+// Multiply/divide unit: operands are latched by port writes,
+// results are computed on the host when PORT_MATH_CMD is written.
+class MathUnit
+{
+private:
+	mWord	xLo, xHi, y;
+	mWord	resLo, resHi, rem;
+	mWord	status;
+
+	void execute( mWord cmd );
+
+public:
+	MathUnit()
+	{
+		reset();
+	}
+
+	void reset();
+	mWord read( mWord port );
+	void write( mWord port, mWord data );
+};
+
+class Bus;
+
+// Host file mapped into memory, writes of writable one go to the file
+class MappedFile
+{
+private:
+	void		*view = nullptr;	// nullptr for empty file
+	size_t		bytes = 0;
+
+public:
+	MappedFile() {};
+	MappedFile( const MappedFile &src ) = delete;
+	~MappedFile()
+	{
+		close();
+	}
+
+	bool open( const std::string &fileName, bool readOnly = true );
+	void close();
+	void *data()
+	{
+		return view;
+	}
+	size_t size()
+	{
+		return bytes;
+	}
+};
+
+// Block storage backed by a memory-mapped host file of little-endian words.
+// A command moves COUNT sectors between the image and memory with one memcpy.
+class StorageDevice
+{
+private:
+	MappedFile	file;
+	mWord		*image = nullptr;
+	uint32_t	sectors = 0;
+	bool		writable = false;
+	uint32_t	sector;
+	mWord		addr, count;
+	mWord		status;
+
+	void execute( mWord cmd, Bus &bus );
+
+public:
+	// registers for checkpoints, image contents are not included
+	struct Registers
+	{
+		uint32_t	sector;
+		mWord		addr, count, status;
+	};
+
+	StorageDevice()
+	{
+		reset();
+	}
+	StorageDevice( const StorageDevice &src ) = delete;
+	~StorageDevice()
+	{
+		detach();
+	}
+
+	bool attach( const std::string &fileName, bool readOnly = false );
+	void detach();
+	Registers getRegisters()
+	{
+		return Registers{ sector, addr, count, status };
+	}
+	void setRegisters( const Registers &r )
+	{
+		sector = r.sector;
+		addr = r.addr;
+		count = r.count;
+		status = r.status;
+	}
+
+	void reset();
+	mWord read( mWord port );
+	void write( mWord port, mWord data, Bus &bus );
+};
+
+// Memory-mapped display. Guest writes only mark dirty tiles, frame() converts dirty
+// tiles to host RGB kept in shared memory file and writes frame as PPM file.
+class Framebuffer
+{
+private:
+	int		base = -1;	// -1 if not attached
+	std::atomic< uint64_t >	dirty{ 0 };	// bit per tile
+	std::vector< uint8_t >	own;	// RGB frame when there is no shared file
+	MappedFile	shared;
+	uint8_t		*rgb = nullptr;
+	std::string	dir;
+	uint32_t	frames = 0;
+	bool		failed = false;	// frame file could not be written
+
+public:
+	Framebuffer() {};
+	Framebuffer( const Framebuffer &src ) = delete;
+
+	// pixels from base, frames are written to dir and/or kept in shared file
+	// of DISPLAY_PIXELS * 3 bytes, it is created if needed; empty names are not used
+	bool attach( mWord base, const std::string &dir, const std::string &sharedFile );
+	// page holds pixels, its writes must be trapped
+	bool covers( int page )
+	{
+		return (base >= 0) && ((page + 1) << PAGE_SHIFT > base) && (page << PAGE_SHIFT < base + DISPLAY_PIXELS);
+	}
+	void mark( mWord addr )
+	{
+		uint32_t offs = uint32_t( addr - base );
+		if ( (base < 0) || (offs >= DISPLAY_PIXELS) )
+			return;
+		uint64_t bit = uint64_t( 1 ) << ((offs / (DISPLAY_WIDTH * DISPLAY_TILE)) * DISPLAY_TILES_X + (offs % DISPLAY_WIDTH) / DISPLAY_TILE);
+		// pixels of tile are usually written together, atomic update only for first one
+		if ( !(dirty.load( std::memory_order_relaxed ) & bit) )
+			dirty.fetch_or( bit, std::memory_order_relaxed );
+	}
+	// memory was remapped or filled by transfer
+	void markAll()
+	{
+		dirty = ~uint64_t( 0 );
+	}
+	// converts dirty tiles, frame file is written if any; false if one was not written
+	bool frame( Bus &bus );
+	uint32_t getFrames()
+	{
+		return frames;
+	}
+};
+
+// Bus cycles charged for each memory access of an instruction
+struct CostModel
+{
+	int	opcode = 1;	// opcode fetch
+	int	immediate = 1;	// X/Y/R immediate or [ psw ] address fetch
+	int	read = 1;	// indirect operand read
+	int	write = 1;	// indirect result write
+	int	port = 0;	// extra for access to I/O page
+};
+
+struct Symbol
+{
+	std::string	name;
+	mWord		addr;
+};
+
+// Timed device event, sources drop events with stale tags
+struct Event
+{
+	uint64_t	when;
+	int		source;
+	uint32_t	tag;
+
+	bool operator >( const Event &other ) const
+	{
+		return when > other.when;
+	}
+};
+
+class TimerDevice
+{
+private:
+	mWord		period, ctrl;
+	uint64_t	deadline;
+	uint32_t	tag = 0;
+
+	uint64_t interval()
+	{
+		return uint64_t( period ) << ((ctrl >> TIMER_PRESCALE_SHIFT) & 0xF);
+	}
+
+public:
+	TimerDevice()
+	{
+		reset();
+	}
+
+	bool armed()
+	{
+		return (ctrl & TIMER_ENABLE) != 0;
+	}
+	Event nextEvent()
+	{
+		return Event{ deadline, EVENT_TIMER, tag };
+	}
+
+	void reset();
+	mWord read( mWord port, uint64_t cycles );
+	// true if timer was (re)armed and nextEvent() must be scheduled
+	bool write( mWord port, mWord data, uint64_t cycles );
+	// true if event is current and interrupt must be raised
+	bool fire( const Event &event );
+};
+
+// Log of I/O page reads for deterministic record/replay.
+// Entry: LEB128 delta of retired instruction count, port offset in I/O page, LEB128 value
+// and LEB128 count of identical reads following at the same distance (polling loops).
+class PortLog
+{
+public:
+	enum Mode
+	{
+		Off,
+		Record,
+		Replay
+	};
+
+private:
+	struct Entry
+	{
+		uint64_t	delta;
+		uint8_t		port;
+		mWord		value;
+		uint64_t	repeat;
+	};
+
+	Mode			mode = Off;
+	std::vector< uint8_t >	data;
+	size_t			pos;
+	uint64_t		last;
+	Entry			cur;
+	bool			pending;
+	size_t			entryPos;	// start of cur in data
+	uint64_t		used;	// reads of cur done
+	bool			append = false;	// replay from cursor goes on recording when log is over
+
+	bool parse();
+
+	void put( uint64_t value );
+	bool get( uint64_t &value );
+	void flush();
+
+public:
+	// position between two reads, for checkpoints
+	struct Cursor
+	{
+		size_t		pos;
+		uint64_t	used;
+		uint64_t	last;
+	};
+
+	Mode getMode()
+	{
+		return mode;
+	}
+
+	void startRecord();
+	void startReplay();
+	void stop()
+	{
+		mode = Off;
+	}
+	bool load( const std::string &fileName );
+	bool save( const std::string &fileName );
+
+	void record( uint64_t retired, mWord port, mWord value );
+	// false if log is over or does not match this read
+	bool replay( uint64_t retired, mWord port, mWord &value );
+
+	Cursor tell();
+	// replays log from cursor, recorded log is kept whole
+	void seek( const Cursor &cursor );
+	// true if replay from cursor is over and recording goes on
+	bool resume();
+	size_t size()
+	{
+		return data.size();
+	}
+	// drops first bytes of log, cursors after them move back by the same amount
+	void trim( size_t bytes );
+};
+
+struct Page
+{
+	mWord	data[ PAGE_WORDS ];
+};
+typedef std::shared_ptr< Page >	PagePtr;
+
+// Base memory pages frozen by Bus::share() to be mapped by other buses
+struct SharedImage
+{
+	PagePtr	pages[ PAGES ];
+};
+
+// Memory and MMU state of bus for checkpoints, pages are shared with bus until written
+struct BusSnapshot
+{
+	std::vector< PagePtr >	phys;
+	mWord		mmuFrame[ MMU_BANKS ];
+	mWord		mmuBank;
+	bool		mmuEnabled;
+	StorageDevice::Registers	disk;
+};
+
+// Slot of software TLB, other cores remap or copy pages while it is read: stores release,
+// loads acquire the page so its copied contents are seen
+typedef std::atomic< mWord * >	PageSlot;
+
+// Memory and devices shared by all cores: RAM, MMU, console, disk and hardware locks.
+// Cores access RAM without synchronisation, guests order their accesses with lock ports.
+// Physical pages may be shared with other buses and are copied on first write.
+class Bus
+{
+private:
+	std::vector< PagePtr >	phys;	// base memory, then MMU frames above it written so far
+	PageSlot	readPage[ PAGES ];	// software TLB: host address of every page
+	PageSlot	writePage[ PAGES ];	// same, but nullptr while page is shared
+	uint32_t	physPage[ PAGES ];	// physical page of every page
+	std::mutex	pageMutex;		// copy-on-write
+	mWord		mmuFrame[ MMU_BANKS ];
+	mWord		mmuBank;
+	bool		mmuEnabled;
+	StorageDevice	disk;
+	Framebuffer	display;
+	std::atomic< mWord >	locks[ BUS_LOCKS ];
+	std::atomic< int >	cores{ 0 };
+	std::mutex	deviceMutex;	// console, disk and MMU
+	// host console: input is pushed and output collected by host instead of terminal
+	bool		hostConsole = false;
+	std::deque< mWord >	input;
+	std::string	output;
+	std::atomic< bool >	starved{ false };	// console was read while input was empty
+	std::function< void() >	inputWaiter;
+
+	void mapBank( int index );
+	void mapPage( int page, uint32_t physical );
+	mWord *privatize( int page );
+
+public:
+	Bus()
+	{
+		reset();
+	}
+	Bus( const Bus &src ) = delete;
+
+	const PageSlot *getReadPages()
+	{
+		return readPage;
+	}
+	const PageSlot *getWritePages()
+	{
+		return writePage;
+	}
+	// host address of page holding addr, copied first if it is shared
+	mWord *pageForWrite( mWord addr )
+	{
+		mWord *p = writePage[ addr >> PAGE_SHIFT ].load( std::memory_order_acquire );
+		return p ? p : privatize( addr >> PAGE_SHIFT );
+	}
+	const mWord *pageForRead( mWord addr )
+	{
+		return readPage[ addr >> PAGE_SHIFT ].load( std::memory_order_acquire );
+	}
+	// page of addr is still the shared page of zeros
+	bool isZeroPage( mWord addr );
+	// RAM access through current mapping, no ports
+	mWord read( mWord addr )
+	{
+		return pageForRead( addr )[ addr & (PAGE_WORDS - 1) ];
+	}
+	void write( mWord addr, mWord data )
+	{
+		pageForWrite( addr )[ addr & (PAGE_WORDS - 1) ] = data;
+	}
+
+	// freezes base memory, this bus keeps using it copying pages on write
+	std::shared_ptr< SharedImage > share();
+	// maps image as base memory
+	void load( const SharedImage &image );
+	BusSnapshot snapshot();
+	void restore( const BusSnapshot &snap );
+	int attachCore()
+	{
+		return cores++;
+	}
+	int getCores()
+	{
+		return cores;
+	}
+	bool attachStorage( const std::string &fileName, bool readOnly = false )
+	{
+		return disk.attach( fileName, readOnly );
+	}
+	Framebuffer &getDisplay()
+	{
+		return display;
+	}
+
+	void setHostConsole( bool enable )
+	{
+		hostConsole = enable;
+	}
+	void pushInput( const std::string &text );
+	std::string takeOutput();
+	bool takeStarved()
+	{
+		return starved.exchange( false );
+	}
+	// false if input is available already, otherwise waiter is called once on next pushInput()
+	bool waitInput( std::function< void() > waiter );
+
+	void reset();
+	mWord readPort( mWord addr );
+	// returns interrupt lines to raise on writing core
+	mWord writePort( mWord addr, mWord data );
+
+	friend class Assembler;
+};
+
+// One processor core: registers, per-core devices (math unit, timer, interrupts) and debugger.
 class Machine
 {
+public:
+	enum StopReason
+	{
+		StopNone,
+		StopHalt,	// nop (zero word) at PC
+		StopLimit,	// step limit of run() reached
+		StopBreakpoint,
+		StopReadWatch,
+		StopWriteWatch,
+		StopReplay,	// port read does not match replayed log
+		StopInputWait,	// host console read while its input is empty
+		StopHook	// native routine differs from guest one in hook validation
+	};
+	// native routine, returns false to leave call to guest code
+	typedef std::function< bool( Machine &m ) >	Hook;
+
 private:
-	mWord		mem[ 65536 ];
+	std::unique_ptr< Bus >	ownBus;	// single core machine
+	Bus		*bus;
+	const PageSlot	*readPage;
+	const PageSlot	*writePage;
+	int		coreId;
 	mWord		reg[ 8 ];
 	Instruction	instr;
+	MathUnit	math;
+	TimerDevice	timer;
+	PortLog		portLog;
 	mWord		x, y, a;
 	uint32_t	tmp;
 
+	mWord peek( mWord addr )
+	{
+		return readPage[ addr >> PAGE_SHIFT ].load( std::memory_order_acquire )[ addr & (PAGE_WORDS - 1) ];
+	}
+	void poke( mWord addr, mWord data )
+	{
+		mWord *p = writePage[ addr >> PAGE_SHIFT ].load( std::memory_order_acquire );
+		if ( p )
+			p[ addr & (PAGE_WORDS - 1) ] = data;
+		else
+			bus->write( addr, data );	// copy-on-write
+	}
+	char *operandText( char *p, mTag r, bool i, mWord at, bool result = false );
 	mWord getMem( mWord addr );
 	void setMem( mWord addr, mWord data );
+	mWord getMemSlow( mWord addr );
+	mWord readPort( mWord addr );
+	void setMemSlow( mWord addr, mWord data );
 	mWord fetch() 
 	{ 
+		cycles += cost.immediate;
+		perf.reads++;
 		return getMem( reg[ REG_PC ]++ );
 	}
+	// operand access, also counted for guest
+	void charge( mWord addr, int access, uint64_t &ramCounter )
+	{
+		cycles += access;
+		if ( addr >= PORT_START )
+		{
+			cycles += cost.port;
+			perf.ports++;
+		}
+		else
+			ramCounter++;
+	}
 	bool getFlag( mTag flag ) 
 	{
 		return (reg[ REG_PSW ] & (1 << flag)) != 0;
@@ -138,29 +747,306 @@ private:
 	}
 	mWord read( mTag r, mTag i );
 
-public:
-	Machine()
+	CostModel	cost;
+	uint64_t	cycles;
+	uint64_t	retired;
+	struct ProfileEntry
 	{
-		reset();
+		uint64_t	cycles;
+		uint64_t	count;
+	};
+	std::vector< ProfileEntry >	profile;	// per instruction address, empty if disabled
+	// memory heatmap: accesses of getMemSlow()/setMemSlow() by address, empty if disabled;
+	// every heatInterval-th access is counted with weight of heatInterval
+	std::vector< uint64_t >	heatReads, heatWrites;
+	uint32_t	heatInterval, heatCountdown;
+	void heat( std::vector< uint64_t > &counters, mWord addr )
+	{
+		if ( --heatCountdown )
+			return;
+		heatCountdown = heatInterval;
+		counters[ addr ] += heatInterval;
+	}
+	struct PerfCounters
+	{
+		uint64_t	reads;
+		uint64_t	writes;
+		uint64_t	branches;
+		uint64_t	ports;
+	};
+	PerfCounters	perf;
+	mWord		perfLatch;	// high word latched by read of low one
+	mWord readPerf( mWord addr );
+	uint64_t	nextEvent;	// cycle when processEvents() has work to do
+	std::priority_queue< Event, std::vector< Event >, std::greater< Event > >	events;
+	mWord		irqVector, irqPending, irqMask;
+	uint64_t	frameInterval;	// cycles between display frames, 0 - off
+	uint32_t	frameTag;	// events of previous interval are dropped
+
+	// reverse execution: state every checkpointInterval instructions, see rewind()
+	struct Checkpoint
+	{
+		uint64_t	retired, cycles;
+		mWord		reg[ 8 ];
+		mWord		x, y, a;
+		uint32_t	tmp;
+		MathUnit	math;
+		TimerDevice	timer;
+		PerfCounters	perf;
+		mWord		perfLatch;
+		std::priority_queue< Event, std::vector< Event >, std::greater< Event > >	events;
+		mWord		irqVector, irqPending, irqMask;
+		BusSnapshot	bus;
+		PortLog::Cursor	log;
+		size_t		pages;	// pages not shared with next checkpoint
+	};
+	std::deque< Checkpoint >	checkpoints;
+	uint64_t	checkpointInterval;	// 0 - off
+	size_t		checkpointLimit;	// KB of pages held by checkpoints only and of port log after first one
+	bool		checkpointLog;	// port log was started for checkpoints and may be trimmed
+	uint64_t	diskWriteEnd;	// retired + 1 at last disk write, earlier checkpoints see other disk
+	uint64_t	nextCheckpoint;
+	uint64_t	horizon;	// most instructions retired yet, console output of re-execution is dropped
+	void takeCheckpoint();
+	void restoreCheckpoint( const Checkpoint &cp );
+	void thinCheckpoints();
+	StopReason runSteps( uint64_t maxSteps, bool first );
+
+	// debugger, breakpoints and watchpoints are bitmaps of 64K bits allocated by first set bit, null is all clear
+	typedef std::unique_ptr< uint64_t[] >	BitMap;
+	BitMap		breakMap, readWatchMap, writeWatchMap;
+	mTag		readTrap[ PAGES ], writeTrap[ PAGES ];
+	bool		debugArmed;	// run() must check for stops: points are set or log is replayed
+	StopReason	stopReason;
+	mWord		stopAddr;
+
+	static bool testBit( const BitMap &map, mWord addr )
+	{
+		return map && ((map[ addr >> 6 ] >> (addr & 63)) & 1);
+	}
+	static bool testWord( const BitMap &map, int i )
+	{
+		return map && map[ i ];
+	}
+	static void setBit( BitMap &map, mWord addr, bool value )
+	{
+		if ( !map )
+		{
+			if ( !value )
+				return;
+			map.reset( new uint64_t[ 1024 ]() );
+		}
+		if ( value )
+			map[ addr >> 6 ] |= uint64_t( 1 ) << (addr & 63);
+		else
+			map[ addr >> 6 ] &= ~(uint64_t( 1 ) << (addr & 63));
+	}
+	void updateTraps( mWord addr );
+	void hit( StopReason reason, mWord addr )
+	{
+		if ( stopReason == StopNone )
+		{
+			stopReason = reason;
+			stopAddr = addr;
+		}
 	}
 
+	// block engine: straight-line runs of predecoded instructions executed by runBlocks()
+	struct DecodedOp
+	{
+		Instruction	instr;
+		mWord		word;	// opcode word, cached blocks are checked against memory
+		mWord		next;	// address of following instruction
+	};
+	struct Block
+	{
+		mWord			start;
+		std::vector< DecodedOp >	ops;
+	};
+	std::vector< Block >	blocks;
+	std::vector< int >	blockAt;	// block index by start address or -1, empty if engine is off
+	BitMap		codeMap;	// decoded opcode words, changing one flushes all blocks
+	mTag		codePage[ PAGES ];	// page has bits in codeMap, its writes are trapped
+	uint64_t	codeGeneration;	// incremented by flush, block in execution is left
+	bool		flushPending;	// blocks are dropped when none is executed
+	std::string	cacheFile;
+	uint64_t	cacheKey;
+	uint64_t	blocksBuilt;
+	int buildBlock( mWord start );
+	int addBlock( Block &&block );
+	void flushBlocks();
+	StopReason runBlocks( uint64_t maxSteps );
+	void execute( mWord pc, uint64_t start );
+
+	// statically compiled code (see Native): changed words are collected for it to drop routines
+	BitMap		nativeMap;
+	std::vector< mWord >	nativeWrites;
+
+	// high-level emulation: native routines run instead of guest code at hooked addresses
+	std::map< mWord, Hook >	hooks;
+	BitMap		hookMap;
+	enum HookMode
+	{
+		HookOff,
+		HookCapture,	// port writes of native routine are kept in hookPorts
+		HookRecord	// port writes of guest routine are copied to hookPorts
+	};
+	HookMode	hookMode;
+	bool		hookValidation;
+	std::vector< std::pair< mWord, mWord > >	hookPorts;
+	std::string	hookDiff;
+	bool callHook( mWord addr );
+	bool validateHook( mWord addr );
+
+	void schedule( const Event &event );
+	void raiseIrq( mWord lines );
+	void updateNextEvent();
+	void processEvents();
+	void interrupt();
+
+public:
+	Machine(): Machine( nullptr ) {};
+	// core on shared bus, nullptr makes machine with its own one
+	explicit Machine( Bus *shared );
+	Machine( const Machine &src ) = delete;
+
 	mWord currentOp()
 	{
-		return mem[ reg[ REG_PC ] ];
+		return peek( reg[ REG_PC ] );
 	}
 	mWord getPC()
 	{
 		return reg[ REG_PC ];
 	}
+	mWord getReg( mTag r )
+	{
+		return reg[ r ];
+	}
+	void setReg( mTag r, mWord value )
+	{
+		reg[ r ] = value;
+	}
+	uint64_t getCycles()
+	{
+		return cycles;
+	}
+	uint64_t getRetired()
+	{
+		return retired;
+	}
+	void setCostModel( const CostModel &model )
+	{
+		cost = model;
+	}
+	void setProfiling( bool enable )
+	{
+		profile.assign( enable ? 65536 : 0, ProfileEntry{ 0, 0 } );
+	}
+	// frame of display attached to bus every interval cycles (0 - off)
+	void setFrameInterval( uint64_t interval );
+	// read and write counters of every address, all pages are trapped while enabled;
+	// only every interval-th access is counted, as interval accesses
+	void setHeatmap( bool enable, uint32_t interval = 1 );
+	// binary: 65536 read then 65536 write uint64_t counters, csv: totals by page and by symbol range
+	bool saveHeatmap( const std::string &fileName, const std::vector< Symbol > &symbols, bool csv );
+	bool attachStorage( const std::string &fileName, bool readOnly = false )
+	{
+		return bus->attachStorage( fileName, readOnly );
+	}
+	int getCoreId()
+	{
+		return coreId;
+	}
+	Bus *getBus()
+	{
+		return bus;
+	}
+
+	void setBreakpoint( mWord addr, bool enable = true );
+	void setWatchpoint( mWord addr, bool onRead, bool onWrite );
+	void clearDebug();
+	StopReason getStopReason()
+	{
+		return stopReason;
+	}
+	// breakpoint address or address of watched access
+	mWord getStopAddr()
+	{
+		return stopAddr;
+	}
+
+	// native routine replaces guest one entered at addr, empty hook removes it
+	void setHook( mWord addr, Hook hook );
+	// every hooked call runs guest code, native result is compared with it
+	void setHookValidation( bool enable )
+	{
+		hookValidation = enable;
+	}
+	// first difference found by validation
+	const std::string &getHookDiff()
+	{
+		return hookDiff;
+	}
+	// memory and ports for native routines, access is not counted
+	mWord load( mWord addr )
+	{
+		return getMem( addr );
+	}
+	void store( mWord addr, mWord data );
+
+	void recordPorts()
+	{
+		checkpointLog = false;
+		portLog.startRecord();
+	}
+	bool savePortLog( const std::string &fileName )
+	{
+		return portLog.save( fileName );
+	}
+	// replay starts from the beginning of log, machine is expected to be reset
+	bool replayPorts( const std::string &fileName );
+
+	// predecoded blocks in run(), code is expected to change by stores of this core,
+	// MMU or disk only; enable after program is loaded
+	void setBlockEngine( bool enable );
+	// content hash of memory below I/O page, key of block cache
+	uint64_t imageHash();
+	// enables block engine and preloads blocks cached in directory for current image
+	bool loadBlocks( const std::string &dir );
+	bool saveBlocks();
+	// blocks decoded since engine was enabled, loaded ones are not counted
+	uint64_t getBlocksBuilt()
+	{
+		return blocksBuilt;
+	}
+
+	// checkpoint every interval instructions (0 - off), port reads are logged for replay;
+	// pages held by checkpoints only are kept under limitKB by dropping every second one
+	void setCheckpoints( uint64_t interval, size_t limitKB );
+	// state after given count of retired instructions: nearest earlier checkpoint is restored
+	// and executed forward, false if there is none or execution did not get there
+	bool rewind( uint64_t target );
+	size_t getCheckpointCount()
+	{
+		return checkpoints.size();
+	}
 
 	void reset();
 	void step();
-	void show();
+	// runs until halt, hit or step limit; breakpoint at starting PC is passed if resuming
+	StopReason run( uint64_t maxSteps = UINT64_MAX, bool resume = true );
+	void show( bool memory = true );
+	void showProfile( const std::vector< Symbol > &symbols );
 
-	std::string operandToStr( mTag r, mTag i, int &addr, bool result = false );
+	// text of instruction at addr without newline into out of DISASM_TEXT chars, addr is
+	// moved past its words; returns end of zero-terminated text, nothing is allocated
+	char *disassemble( mWord &addr, char *out );
 	void showDisasm( int addr );
+	// instructions from..to with labels of symbols sorted by address, untouched pages are skipped
+	void listing( std::ostream &out, mWord from, mWord to, const std::vector< Symbol > &symbols );
 
 	friend class Assembler;
+	friend struct Native;	// statically recompiled code, see aot.cpp
 };
 
 }	// namespace Simpleton
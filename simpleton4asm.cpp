@@ -1,5 +1,8 @@
 #include "simpleton4asm.h"
 #include <conio.h>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
 
 namespace Simpleton
 {
@@ -8,7 +11,7 @@ void Assembler::reset()
 {
 	org = 0;
 	files.clear();
-	lines.clear();
+	lineCount = 0;
 	identifiers.clear();
 	forwards.clear();
 }
@@ -19,6 +22,8 @@ void Assembler::parseStart()
 	curLabel.clear();
 	lineNum = 0;
 	errorMessage.clear();
+	newSyntaxMode = false;
+	hooks.clear();
 
 	identifiers.clear();
 	identifiers.emplace_back( "r0",		Identifier::Register, REG_R0,	Identifier::AsmBoth );
@@ -94,20 +99,30 @@ void Assembler::parseEnd()
 {
 	for ( auto &fwd : forwards )
 	{
-		Identifier *iden = findIdentifier( fwd.name, false );
-		if ( iden == nullptr )
-			throw ParseError( fwd.lineNum, "unknown forward reference '" + fwd.name + "'!" );
-		if ( iden->type != Identifier::Symbol )
-			throw ParseError( fwd.lineNum, "forward reference '" + fwd.name + "' is not symbol!" );
+		int value;
+		if ( fwd.name[ 0 ] == '(' )
+		{
+			if ( !evalExpr( fwd.name, value, fwd.lineNum ) )
+				throw ParseError( fwd.lineNum, "unknown symbol in forward expression '" + fwd.name + "'!" );
+		}
+		else
+		{
+			Identifier *iden = findIdentifier( fwd.name, false );
+			if ( iden == nullptr )
+				throw ParseError( fwd.lineNum, "unknown forward reference '" + fwd.name + "'!" );
+			if ( iden->type != Identifier::Symbol )
+				throw ParseError( fwd.lineNum, "forward reference '" + fwd.name + "' is not symbol!" );
+			value = iden->value;
+		}
 		if ( fwd.cadd )
 		{
-			int offs = (iden->value & 0xFFFF) - fwd.addr - 1;
+			int offs = (value & 0xFFFF) - fwd.addr - 1;
 			if ( (offs < -4096) || (offs > 4095) )
 				throw ParseError( fwd.lineNum, "conditional jump offset is too big (" + std::to_string( offs ) + ")!" );
-			machine->mem[ fwd.addr ] |= (offs & 0x1FFF);
+			write( fwd.addr, read( fwd.addr ) | (offs & 0x1FFF) );
 		}
 		else
-			machine->mem[ fwd.addr ] = iden->value;
+			write( fwd.addr, value );
 	};
 }
 
@@ -208,6 +223,16 @@ mWord Assembler::parseConstExpr( const std::string &expr, int addrForForward )
 	int value = 0;
 	if ( expr.empty() )
 		throw ParseError( lineNum, "constexpr expected!" );
+	if ( expr[ 0 ] == '(' )
+	{
+		std::string text = collectExpr( expr );
+		if ( evalExpr( text, value, lineNum ) )
+			return value;
+		if ( addrForForward == -1 )
+			throw ParseError( lineNum, "symbol in constexpr '" + text + "' does not exist!" );
+		forwards.emplace_back( text, addrForForward, lineNum );
+		return 0;
+	}
 	if ( lexemIsNumberLiteral( expr ) )
 	{
 		value = parseNumberLiteral( expr );
@@ -294,6 +319,7 @@ void Assembler::parseLine()
 		if ( findIdentifier( curLabel, newSyntax ) != nullptr )
 			throw ParseError( lineNum, "identifier " + curLabel + " is redefined!" );
 		identifiers.emplace_back( curLabel, Identifier::Symbol, org, Identifier::AsmBoth );
+		labelAddr = org;
 		//std::cout << "New identif added: " << curLabel << "\n";
 	}
 	std::string lexem;
@@ -309,6 +335,7 @@ void Assembler::parseLine()
 				if ( iden == nullptr )
 					throw ParseError( lineNum, "Current label does not exist!" );
 				iden->value = org;
+				labelAddr = org;
 			}
 			return;	// no futher actions required
 		}
@@ -321,6 +348,7 @@ void Assembler::parseLine()
 			if ( iden == nullptr )
 				throw ParseError( lineNum, "Current label does not exist!" );
 			iden->value = word;
+			iden->equ = true;
 			return;	// no futher actions required
 		}
 		else if ( first && (lexem == "mode") )
@@ -360,6 +388,15 @@ void Assembler::parseLine()
 			};
 			return;	// no futher actions required
 		}
+		else if ( first && (lexem == "hook") )
+		{
+			// native routine replaces code at this address, see simpleton4hle.h
+			lexem = getNextLexem();
+			if ( lexem.empty() || (lexem == ";") )
+				throw ParseError( lineNum, "HOOK requres name of native routine!" );
+			hooks.push_back( Symbol{ lexem, org } );
+			return;	// no futher actions required
+		}
 		else if ( first && (lexem == "ds") )
 		{
 			lexem = getNextLexem();
@@ -372,8 +409,20 @@ void Assembler::parseLine()
 		        {
 		        	fill = parseConstExpr( lexem );
 		        };
-		        for ( int i = 0; i < size; i++ )
-		        	data( fill );
+		        if ( fill == 0 )
+		        	zeros( size );
+		        else
+		        	bulk( size, [ fill ]( int ) { return fill; } );
+			return;	// no futher actions required
+		}
+		else if ( first && (lexem == "incbin") )
+		{
+			incbin();
+			return;	// no futher actions required
+		}
+		else if ( first && (lexem == "table") )
+		{
+			table();
 			return;	// no futher actions required
 		}
 		else if ( lexemIsNumberLiteral( lexem ) )
@@ -385,6 +434,15 @@ void Assembler::parseLine()
 
 			stage++;
 		}
+		else if ( lexem[ 0 ] == '(' )
+		{
+			std::string expr = collectExpr( lexem );
+			int value;
+			bool known = evalExpr( expr, value, lineNum );
+			processArgument( "expression", expr, indirect ? IND_IMMED : IMMED, value, !known );
+
+			stage++;
+		}
 		else if ( (lexem == "=") && newSyntax )
 		{
 			if ( stage != 1 )
@@ -534,6 +592,13 @@ void Assembler::parseLine()
 		x = emitX & 0b1111;
 	}
 
+	int start = org;
+	if ( optimize && !dryRun && !emitForCall && peephole() )
+	{
+		emitted.push_back( Emitted{ -1, 0, cmd, r, y, x } );
+		return;
+	}
+
 	if ( emitForCall )
 		op( OP_ADDIS, IND_SP, REG_PC, 2 );
 
@@ -577,24 +642,120 @@ void Assembler::parseLine()
 			forwards.emplace_back( fwdR, org - 1, lineNum );
 	}
 
+	if ( optimize )
+	{
+		lastOp = int( emitted.size() );
+		emitted.push_back( Emitted{ start, org - start, cmd, r, y, x } );
+	}
 }
 
-void Assembler::preProcessFile( const std::string &fileName )
+// Second pass: instruction is changed in place before it is emitted,
+// true if it was merged into previous one and nothing is emitted
+bool Assembler::peephole()
+{
+	size_t index = emitted.size();
+	bool dead = (index < flagsDead.size()) && flagsDead[ index ];
+	bool plain = (r <= REG_SP);	// r0..r4 and sp, not pc or psw or memory
+	int k = (x & 8) ? x - 16 : x;
+	if ( plain && (y == IMMED) && fwdY.empty() && (((emitY + k) & 0xFFFF) == 0) )
+	{
+		// r <- 0: xor leaves C=0 Z=1 S=0 as addi with zero sum does
+		bool noCarry = ((emitY & 0xFFFF) == 0) && (k == 0);
+		if ( ((cmd == OP_ADDIS) && dead) || ((cmd == OP_ADDI) && (dead || noCarry)) )
+		{
+			cmd = OP_XOR;
+			y = x = r;
+			stats.rewritten++;
+			stats.words++;
+			stats.cycles++;	// immediate fetch
+			return false;
+		}
+	}
+	if ( dead && ((cmd == OP_ADD) || (cmd == OP_ADDI)) )
+	{
+		cmd = (cmd == OP_ADD) ? OP_ADDS : OP_ADDIS;
+		stats.rewritten++;
+	}
+	// r <- r + k after r <- y + j is r <- y + (j + k)
+	if ( (cmd != OP_ADDIS) || !plain || (y != r) || (labelAddr == org) || (lastOp < 0) )
+		return false;
+	Emitted &prev = emitted[ lastOp ];
+	int j = (prev.x & 8) ? prev.x - 16 : prev.x;
+	if ( (prev.cmd != OP_ADDIS) || (prev.r != r) || (prev.addr + prev.words != org) || (j + k < -8) || (j + k > 7) )
+		return false;
+	prev.x = (j + k) & 0b1111;
+	write( prev.addr, Instruction::encode( prev.cmd, prev.r, prev.y, prev.x ) );
+	stats.rewritten++;
+	stats.words++;
+	stats.cycles++;	// opcode fetch
+	return true;
+}
+
+// First pass: flags after instruction are dead if next one in memory overwrites them
+// before any read. Jump, end of code or data ends the search, flags are live there.
+void Assembler::analyzeFlags()
+{
+	flagsDead.assign( emitted.size(), false );
+	bool nextDead = false;	// flags are dead at start of instruction i + 1
+	for ( int i = int( emitted.size() ) - 1; i >= 0; i-- )
+	{
+		const Emitted &e = emitted[ i ];
+		bool follows = (size_t( i ) + 1 < emitted.size()) && (emitted[ i + 1 ].addr == e.addr + e.words);
+		flagsDead[ i ] = follows && (e.r != REG_PC) && nextDead;
+		bool reads = (e.cmd == OP_ADC) || (e.cmd == OP_SBC) || (e.cmd == OP_CADD) ||
+				(e.y == REG_PSW) || (!Instruction::isInplaceImmediate( e.cmd ) && (e.x == REG_PSW));
+		bool writes = (e.r == REG_PSW) || (e.cmd == OP_ADD) || (e.cmd == OP_ADDI) || (e.cmd == OP_ADC) ||
+				(e.cmd == OP_SUB) || (e.cmd == OP_SBC) || (e.cmd == OP_AND) || (e.cmd == OP_OR) || (e.cmd == OP_XOR);
+		nextDead = !reads && (writes || flagsDead[ i ]);
+	}
+}
+
+// reads whole file, default include resolver
+static bool readFile( const std::string &name, std::string &text )
+{
+	std::ifstream ifs( name, std::ios::binary );
+	if ( ifs.fail() )
+		return false;
+	text.assign( std::istreambuf_iterator< char >( ifs ), std::istreambuf_iterator< char >() );
+	return true;
+}
+
+void Assembler::preProcessFile( const std::string &fileName, const IncludeResolver &resolver, int depth )
 {
-	std::string line;
-	int innerLineNum = 1;
 	int fileNum = files.size();
 	files.emplace_back( fileName );
-	std::ifstream ifs( fileName );
-	if ( ifs.fail() )
+	// text of every nesting level stays in place while nested files are read
+	if ( includeText.size() <= size_t( depth ) )
+		includeText.resize( depth + 1 );
+	std::string &text = includeText[ depth ];
+	if ( !(resolver ? resolver( fileName, text ) : readFile( fileName, text )) )
 		throw PreProcessorError( fileNum - 1, lineNum, "cannot open file '" + fileName + "'!" );
-	while ( std::getline( ifs, line ) )
+	preProcessText( text, fileNum, resolver, depth );
+}
+
+void Assembler::preProcessText( std::string_view text, int fileNum, const IncludeResolver &resolver, int depth )
+{
+	int innerLineNum = 1;
+	size_t pos = 0;
+	while ( pos < text.size() )
 	{
+		size_t end = text.find( '\n', pos );
+		if ( end == std::string_view::npos )
+			end = text.size();
+		lineBuffer.assign( text.data() + pos, end - pos );
+		if ( !lineBuffer.empty() && (lineBuffer.back() == '\r') )
+			lineBuffer.pop_back();
+		pos = end + 1;
+
 		lineNum++;
 		innerLineNum++;
-		std::vector< std::string > lexems;
+		// lines are reused from previous runs with their lexem buffers
+		if ( size_t( lineCount ) == lines.size() )
+			lines.emplace_back();
+		SourceLine &line = lines[ lineCount ];
+		std::vector< std::string > &lexems = line.lexems;
 		bool hasLabel;
-		extractLexems( line, lexems, hasLabel );
+		extractLexems( lineBuffer, lexems, hasLabel );
 		if ( (lexems.size() > 0) && (lexems[ 0 ][ 0 ] == '#') )
 		{
 			if ( lexems[ 0 ] == "#include" )
@@ -603,7 +764,7 @@ void Assembler::preProcessFile( const std::string &fileName )
 					throw PreProcessorError( fileNum, innerLineNum, "#include directive must has one string parameter!" );
 				if ( lexems[ 1 ][ 0 ] != '"' )
 					throw PreProcessorError( fileNum, innerLineNum, "#include directive parameter must be quoted string!" );
-				preProcessFile( &lexems[ 1 ][ 1 ] );
+				preProcessFile( lexems[ 1 ].substr( 1 ), resolver, depth + 1 );
 			}
 			else
 			{
@@ -613,20 +774,81 @@ void Assembler::preProcessFile( const std::string &fileName )
 		else
 		{
 			if ( lexems.size() > 0 )
-				lines.emplace_back( fileNum, innerLineNum, hasLabel, lexems );
+			{
+				line.file = fileNum;
+				line.num = innerLineNum;
+				line.label = hasLabel;
+				lineCount++;
+			}
 		}
 	};
 }
 
 bool Assembler::parseFile( const std::string &fileName )
 {
+	return process( nullptr, fileName, nullptr );
+}
+
+bool Assembler::assemble( std::string_view source, const IncludeResolver &resolver )
+{
+	org = 0;
+	return process( &source, "<source>", resolver );
+}
+
+// parses preprocessed lines, emitted instructions are kept for peephole pass
+void Assembler::parseLines()
+{
+	parseStart();
+	emitted.clear();
+	lastOp = labelAddr = -1;
+	for ( int i = 0; i < lineCount; i++ )
+	{
+		lineNum++;
+		curLexem = 0;
+		curLabel.clear();
+
+		std::vector< std::string > &lexems = lines[ i ].lexems;
+		if ( lines[ i ].label )
+			if ( lexems[ 0 ][ 0 ] != '.' )
+				lastLabel = lexems[ 0 ];	// update last label if it is not local
+		// explode local ifentifiers
+		for ( int j = 0; j < lexems.size(); j++ )
+		{
+			if ( lexems[ j ][ 0 ] == '.' )
+				lexems[ j ] = lastLabel + lexems[ j ];
+		}
+		if ( lines[ i ].label )	// assign current label if needed
+		{
+			curLabel = lines[ i ].lexems[ 0 ];
+			curLexem++;
+		}
+		parseLine();
+	}
+}
+
+// preprocesses file or source text and assembles it
+bool Assembler::process( const std::string_view *source, const std::string &fileName, const IncludeResolver &resolver )
+{
+	files.clear();
+	lineCount = 0;
+	this->resolver = resolver ? &resolver : nullptr;
+	dryRun = false;
+	stats = PeepholeStats();
+	if ( !machine )
+		std::fill( image.begin(), image.end(), 0 );
 	try
 	{
 		lineNum = 0;
-		preProcessFile( fileName ); // preprocess
+		if ( source )
+		{
+			files.emplace_back( fileName );
+			preProcessText( *source, 0, resolver, 0 );
+		}
+		else
+			preProcessFile( fileName, resolver, 0 ); // preprocess
 		// Preprocessed source dump:
 		/*
-		for ( int i = 0; i < lines.size(); i++ )
+		for ( int i = 0; i < lineCount; i++ )
 		{
 			std::cout << "File " << lines[ i ].file << " line " << lines[ i ].num << ":";
 			if ( !lines[ i ].label ) std::cout << "    ";
@@ -638,31 +860,25 @@ bool Assembler::parseFile( const std::string &fileName )
 		}
 		*/
 		// Assemble source code:
-		parseStart();
-		std::string line;
-		for ( int i = 0; i < lines.size(); i++ )
-		{
-			lineNum++;
-			curLexem = 0;
-			curLabel.clear();
-
-			std::vector< std::string > &lexems = lines[ i ].lexems;
-			if ( lines[ i ].label )
-				if ( lexems[ 0 ][ 0 ] != '.' )
-					lastLabel = lexems[ 0 ];	// update last label if it is not local
-			// explode local ifentifiers
-			for ( int j = 0; j < lexems.size(); j++ )
-			{
-				if ( lexems[ j ][ 0 ] == '.' )
-					lexems[ j ] = lastLabel + lexems[ j ];
-			}
-			if ( lines[ i ].label )	// assign current label if needed
-			{
-				curLabel = lines[ i ].lexems[ 0 ];
-				curLexem++;
-			}
-			parseLine();
+		if ( optimize )
+		{
+			// lexems are changed by parsing, second pass gets them as preprocessed
+			std::vector< SourceLine > preprocessed( lines.begin(), lines.begin() + lineCount );
+			mWord startOrg = org;
+			if ( machine )
+				image.assign( 65536, 0 );
+			dryRun = true;
+			parseLines();
+			dryRun = false;
+			analyzeFlags();
+			std::copy( preprocessed.begin(), preprocessed.end(), lines.begin() );
+			org = startOrg;
+			if ( machine )
+				std::vector< mWord >().swap( image );
+			else
+				std::fill( image.begin(), image.end(), 0 );
 		}
+		parseLines();
 		parseEnd();
 		// Dump identifiers...
 		/*
@@ -690,7 +906,7 @@ bool Assembler::parseFile( const std::string &fileName )
 		line.num = 0;
 		line.label = false;
 		SourceFile file{ "<unknown>" };
-		if ( (errorLine > 0) && (errorLine <= lines.size()) )
+		if ( (errorLine > 0) && (errorLine <= lineCount) )
 			line = lines[ errorLine - 1 ];
 		if ( (line.file >= 0) && (line.file < files.size()) )
 			file = files[ line.file ];
@@ -706,4 +922,331 @@ bool Assembler::parseFile( const std::string &fileName )
 	return true;
 };
 
+// Constant expression with C operators and precedence over int values wrapping at 32 bits
+// (no overflow is undefined), results are truncated to word where they are used. Symbols come from callback, undefined ones count as 0.
+class ExprEval
+{
+private:
+	struct Token
+	{
+		enum Kind { Number, Name, Op, End }	kind;
+		std::string	text;
+		int		value;
+	};
+	std::vector< Token >	tokens;
+	size_t			pos = 0;
+	const std::function< bool( const std::string &name, int &value ) >	&lookup;
+	int			line;
+	bool			known = true;
+
+	static const int LEVELS = 10;
+
+	void tokenize( const std::string &text )
+	{
+		static const char *ops[] = { "<<", ">>", "<=", ">=", "==", "!=", "&&", "||",
+			"+", "-", "*", "/", "%", "&", "|", "^", "~", "!", "<", ">", "(", ")" };
+		size_t i = 0;
+		while ( i < text.size() )
+		{
+			char c = text[ i ];
+			if ( isspace( c ) )
+			{
+				i++;
+				continue;
+			}
+			if ( (c == '$') || isdigit( c ) )
+			{
+				size_t start = i++;
+				while ( (i < text.size()) && (isdigit( text[ i ] ) || ((text[ start ] == '$') && isxdigit( text[ i ] ))) )
+					i++;
+				tokens.push_back( Token{ Token::Number, "", parseNumberLiteral( text.substr( start, i - start ) ) } );
+				continue;
+			}
+			if ( isalpha( c ) || (c == '_') || (c == '.') )
+			{
+				size_t start = i++;
+				while ( (i < text.size()) && (isalnum( text[ i ] ) || (text[ i ] == '_') || (text[ i ] == '.')) )
+					i++;
+				tokens.push_back( Token{ Token::Name, text.substr( start, i - start ), 0 } );
+				continue;
+			}
+			const char *op = nullptr;
+			for ( const char *o : ops )
+			{
+				if ( text.compare( i, strlen( o ), o ) == 0 )
+				{
+					op = o;
+					break;
+				}
+			}
+			if ( op == nullptr )
+				throw ParseError( line, std::string( "unexpected '" ) + c + "' in expression!" );
+			tokens.push_back( Token{ Token::Op, op, 0 } );
+			i += strlen( op );
+		}
+		tokens.push_back( Token{ Token::End, "", 0 } );
+	}
+
+	bool take( const char *op )
+	{
+		if ( (tokens[ pos ].kind != Token::Op) || (tokens[ pos ].text != op) )
+			return false;
+		pos++;
+		return true;
+	}
+
+	// operators of binary level, lowest precedence first
+	static const std::vector< const char * > &levelOps( int level )
+	{
+		static const std::vector< const char * > levels[ LEVELS ] = {
+			{ "||" }, { "&&" }, { "|" }, { "^" }, { "&" }, { "==", "!=" },
+			{ "<", "<=", ">", ">=" }, { "<<", ">>" }, { "+", "-" }, { "*", "/", "%" } };
+		return levels[ level ];
+	}
+
+	int apply( const std::string &op, int a, int b )
+	{
+		if ( ((op == "/") || (op == "%")) && (b == 0) )
+		{
+			if ( known )
+				throw ParseError( line, "division by zero in expression!" );
+			return 0;
+		}
+		if ( op == "||" ) return a || b;
+		if ( op == "&&" ) return a && b;
+		if ( op == "|" ) return a | b;
+		if ( op == "^" ) return a ^ b;
+		if ( op == "&" ) return a & b;
+		if ( op == "==" ) return a == b;
+		if ( op == "!=" ) return a != b;
+		if ( op == "<" ) return a < b;
+		if ( op == "<=" ) return a <= b;
+		if ( op == ">" ) return a > b;
+		if ( op == ">=" ) return a >= b;
+		if ( op == "<<" ) return int( unsigned( a ) << (b & 31) );
+		if ( op == ">>" ) return a >> (b & 31);
+		if ( op == "+" ) return int( unsigned( a ) + unsigned( b ) );
+		if ( op == "-" ) return int( unsigned( a ) - unsigned( b ) );
+		if ( op == "*" ) return int( unsigned( a ) * unsigned( b ) );
+		if ( b == -1 )	// INT_MIN / -1 overflows
+			return (op == "/") ? int( 0u - unsigned( a ) ) : 0;
+		if ( op == "/" ) return a / b;
+		return a % b;
+	}
+
+	int binary( int level )
+	{
+		if ( level == LEVELS )
+			return unary();
+		int value = binary( level + 1 );
+		while ( true )
+		{
+			const char *found = nullptr;
+			for ( const char *op : levelOps( level ) )
+			{
+				if ( take( op ) )
+				{
+					found = op;
+					break;
+				}
+			}
+			if ( found == nullptr )
+				return value;
+			value = apply( found, value, binary( level + 1 ) );
+		}
+	}
+
+	int unary()
+	{
+		const Token &t = tokens[ pos ];
+		if ( take( "-" ) )
+			return int( 0u - unsigned( unary() ) );
+		if ( take( "+" ) )
+			return unary();
+		if ( take( "~" ) )
+			return ~unary();
+		if ( take( "!" ) )
+			return !unary();
+		if ( take( "(" ) )
+		{
+			int value = binary( 0 );
+			if ( !take( ")" ) )
+				throw ParseError( line, "')' expected in expression!" );
+			return value;
+		}
+		pos++;
+		if ( t.kind == Token::Number )
+			return t.value;
+		if ( t.kind == Token::Name )
+		{
+			int value = 0;
+			if ( !lookup( t.text, value ) )
+				known = false;
+			return value;
+		}
+		throw ParseError( line, "operand expected in expression!" );
+	}
+
+public:
+	ExprEval( const std::function< bool( const std::string &name, int &value ) > &_lookup, int _line ): lookup( _lookup ), line( _line ) {};
+
+	bool eval( const std::string &text, int &value )
+	{
+		tokenize( text );
+		value = binary( 0 );
+		if ( tokens[ pos ].kind != Token::End )
+			throw ParseError( line, "unexpected '" + tokens[ pos ].text + "' in expression!" );
+		return known;
+	}
+};
+
+std::string Assembler::collectExpr( const std::string &lexem )
+{
+	std::string text = lexem;
+	auto depth = [ &text ]() { return std::count( text.begin(), text.end(), '(' ) - std::count( text.begin(), text.end(), ')' ); };
+	while ( depth() > 0 )
+	{
+		std::string next = getNextLexem();
+		if ( next.empty() )
+			throw ParseError( lineNum, "')' expected in expression '" + text + "'!" );
+		text += " " + next;
+	}
+	// local labels belong to last global one, forward expression is evaluated after it changes
+	std::string res;
+	for ( size_t i = 0; i < text.size(); i++ )
+	{
+		if ( (text[ i ] == '.') && ((i == 0) || !(isalnum( text[ i - 1 ] ) || (text[ i - 1 ] == '_'))) )
+			res += lastLabel;
+		res += text[ i ];
+	}
+	return res;
+}
+
+bool Assembler::evalExpr( const std::string &expr, int &value, int line )
+{
+	std::function< bool( const std::string &name, int &value ) > lookup = [ this, line ]( const std::string &name, int &v )
+	{
+		Identifier *iden = findIdentifier( name, false );
+		if ( iden == nullptr )
+			return false;
+		if ( iden->type != Identifier::Symbol )
+			throw ParseError( line, "identifier '" + name + "' in expression is not symbol!" );
+		v = iden->value;
+		return true;
+	};
+	return ExprEval( lookup, line ).eval( expr, value );
+}
+
+static const double PI = 3.14159265358979323846;
+
+// table sin|cos count amplitude, table recip count scale, table crc16 poly:
+// lookup tables computed by assembler
+void Assembler::table()
+{
+	std::string kind = getNextLexem();
+	if ( (kind == "sin") || (kind == "cos") )
+	{
+		int count = parseConstExpr( getNextLexem() );
+		int amplitude = parseConstExpr( getNextLexem() );
+		double phase = (kind == "cos") ? PI / 2 : 0;
+		bulk( count, [ count, amplitude, phase ]( int i ) { return mWord( lround( amplitude * sin( 2 * PI * i / count + phase ) ) ); } );
+	}
+	else if ( kind == "recip" )
+	{
+		// scale / i rounded, $FFFF for 0 and for overflow
+		int count = parseConstExpr( getNextLexem() );
+		double scale = mWord( parseConstExpr( getNextLexem() ) );
+		bulk( count, [ scale ]( int i ) { return mWord( ((i == 0) || (scale / i > 0xFFFF)) ? 0xFFFF : lround( scale / i ) ); } );
+	}
+	else if ( kind == "crc16" )
+	{
+		// entry for every byte value, MSB first
+		mWord poly = parseConstExpr( getNextLexem() );
+		bulk( 256, [ poly ]( int i )
+		{
+			mWord crc = i << 8;
+			for ( int b = 0; b < 8; b++ )
+				crc = (crc & 0x8000) ? mWord( (crc << 1) ^ poly ) : mWord( crc << 1 );
+			return crc;
+		} );
+	}
+	else
+		throw ParseError( lineNum, "TABLE kind must be sin, cos, recip or crc16!" );
+}
+
+// incbin "file" [byte|word|wordbe] [offset [count]]: bytes or 16-bit words of host file,
+// offset and count are in these units
+void Assembler::incbin()
+{
+	std::string lexem = getNextLexem();
+	if ( lexem.empty() || (lexem[ 0 ] != '"') )
+		throw ParseError( lineNum, "INCBIN requres file name in quotes!" );
+	std::string fileName = lexem.substr( 1 );
+	int unit = 1;
+	bool bigEndian = false;
+	lexem = getNextLexem();
+	if ( (lexem == "byte") || (lexem == "word") || (lexem == "wordbe") )
+	{
+		unit = (lexem == "byte") ? 1 : 2;
+		bigEndian = (lexem == "wordbe");
+		lexem = getNextLexem();
+	}
+	size_t offset = 0, count = SIZE_MAX;
+	if ( !lexem.empty() && (lexem != ";") )
+	{
+		offset = parseConstExpr( lexem );
+		lexem = getNextLexem();
+		if ( !lexem.empty() && (lexem != ";") )
+			count = parseConstExpr( lexem );
+	}
+
+	// resolver of assemble() supplies binary files as text ones, others are mapped
+	MappedFile file;
+	std::string text;
+	const uint8_t *bytes;
+	size_t size;
+	if ( resolver && *resolver )
+	{
+		if ( !(*resolver)( fileName, text ) )
+			throw ParseError( lineNum, "cannot open file '" + fileName + "'!" );
+		bytes = reinterpret_cast< const uint8_t * >( text.data() );
+		size = text.size();
+	}
+	else
+	{
+		if ( !file.open( fileName ) )
+			throw ParseError( lineNum, "cannot open file '" + fileName + "'!" );
+		bytes = static_cast< const uint8_t * >( file.data() );
+		size = file.size();
+	}
+	size_t units = size / unit;
+	if ( offset > units )
+		throw ParseError( lineNum, "INCBIN offset is beyond end of file '" + fileName + "'!" );
+	count = std::min( count, units - offset );
+	if ( org + count > 65536 )
+		throw ParseError( lineNum, "INCBIN data does not fit into memory!" );
+	const uint8_t *src = bytes + offset * unit;
+	if ( unit == 1 )
+		bulk( count, [ src ]( int i ) { return mWord( src[ i ] ); } );
+	else if ( bigEndian )
+		bulk( count, [ src ]( int i ) { return mWord( (src[ i * 2 ] << 8) | src[ i * 2 + 1 ] ); } );
+	else
+		bulk( count, [ src ]( int i ) { return mWord( src[ i * 2 ] | (src[ i * 2 + 1 ] << 8) ); } );
+}
+
+std::vector< Symbol > Assembler::getSymbols( bool withLocals )
+{
+	std::vector< Symbol > res;
+	for ( auto &i : identifiers )
+	{
+		if ( (i.type != Identifier::Symbol) || i.equ )
+			continue;
+		if ( !withLocals && (i.name.find( '.' ) != std::string::npos) )
+			continue;
+		res.push_back( Symbol{ i.name, mWord( i.value ) } );
+	}
+	std::stable_sort( res.begin(), res.end(), []( const Symbol &a, const Symbol &b ) { return a.addr < b.addr; } );
+	return res;
+}
+
 }	// namespace Simpleton
@@ -5,8 +5,11 @@
 #include <fstream>
 #include <iomanip>
 #include <string>
+#include <string_view>
 #include <map>
 #include <vector>
+#include <deque>
+#include <functional>
 #include "simpleton4.h"
 
 namespace Simpleton
@@ -34,6 +37,19 @@ public:
 	const std::string &getReason() const { return reason; };
 };
 
+// fills text of included file, false if it does not exist
+typedef std::function< bool( const std::string &name, std::string &text ) >	IncludeResolver;
+
+// words and cycles (default cost model) saved by peephole pass
+struct PeepholeStats
+{
+	int	rewritten = 0;	// instructions changed or merged
+	int	words = 0;
+	int	cycles = 0;	// by one execution of each rewritten instruction
+};
+
+// Assembler keeps its parse state in members, so every thread needs own instance.
+// Instance may be reused, buffers are kept between calls to save allocations.
 class Assembler
 {
 private:
@@ -55,7 +71,10 @@ private:
 				file( f ), num( n ), label( lb ), lexems( lx ) {};
 	};
 	std::vector< SourceFile > files;
-	std::vector< SourceLine > lines;
+	std::vector< SourceLine > lines;	// first lineCount are used, rest are kept for reuse
+	int		lineCount = 0;
+	std::string	lineBuffer;
+	std::deque< std::string >	includeText;	// per nesting level
 
 	struct Identifier
 	{
@@ -77,10 +96,11 @@ private:
 		Mode mode;
 		Type type;
 		int value;
+		bool equ = false;	// symbol is assigned by '=' rather than being a label
 
 		Identifier() {};
 		Identifier( const std::string &_name, Type _type, int _value, Mode _mode ): name( _name ), type( _type ), value( _value ), mode( _mode ) {};
-		Identifier( const Identifier &src ): name( src.name ), type( src.type ), value( src.value ), mode( src.mode ) {};
+		Identifier( const Identifier &src ): name( src.name ), type( src.type ), value( src.value ), mode( src.mode ), equ( src.equ ) {};
 	};
 
 	struct ForwardReference
@@ -94,7 +114,8 @@ private:
 		ForwardReference( const ForwardReference &src ): name( src.name ), addr( src.addr ), lineNum( src.lineNum ), cadd( src.cadd ) {};
 	};
 
-	Machine		*machine;
+	Machine		*machine;	// nullptr for standalone image
+	std::vector< mWord >	image;
 	mWord		org = 0;
 	std::string	errorMessage;
 	int		lineNum;
@@ -103,6 +124,22 @@ private:
 	int		curLexem;
 	std::vector< Identifier >	identifiers;
 	std::vector< ForwardReference >	forwards;
+	const IncludeResolver	*resolver = nullptr;	// of current run, also gives incbin data
+	std::vector< Symbol >	hooks;	// 'hook name' directives, name of native routine and address
+	// peephole pass: source is assembled twice, first pass finds where flags are dead
+	struct Emitted
+	{
+		int	addr;	// first word, -1 if merged into previous instruction
+		int	words;
+		int	cmd, r, y, x;	// as encoded, x is in-place immediate of addi/addis
+	};
+	bool		optimize = false;
+	bool		dryRun = false;	// first pass writes to own image only
+	std::vector< Emitted >	emitted;	// instructions of current pass in source order
+	std::vector< bool >	flagsDead;	// by instruction of first pass: flags are overwritten before read
+	int		lastOp;		// index of last instruction not merged
+	int		labelAddr;	// address of last label, instruction there is not merged
+	PeepholeStats	stats;
 	bool newSyntaxMode = false;
 	// Current state of line parsing
 	bool newSyntax, indirect;
@@ -117,11 +154,66 @@ private:
 	void extractLexems( const std::string &parseString, std::vector< std::string > &data, bool &hasLabel );
 
 	void parseLine();
+	bool peephole();
+	void analyzeFlags();
+	void parseLines();
 	std::string getNextLexem();
 
+	void write( mWord addr, mWord data )
+	{
+		if ( machine && !dryRun )
+			machine->bus->write( addr, data );
+		else
+			image[ addr ] = data;
+	}
+	mWord read( mWord addr )
+	{
+		return (machine && !dryRun) ? machine->bus->read( addr ) : image[ addr ];
+	}
+	// count words from org a page at a time, word( i ) gives i-th one
+	template< class F > void bulk( int count, F word )
+	{
+		for ( int done = 0; done < count; )
+		{
+			int offset = org & (PAGE_WORDS - 1);
+			int n = std::min( count - done, PAGE_WORDS - offset );
+			mWord *p = (machine && !dryRun) ? machine->bus->pageForWrite( org ) + offset : &image[ org ];
+			for ( int i = 0; i < n; i++ )
+				p[ i ] = word( done + i );
+			done += n;
+			org += n;
+		}
+	}
+	// bulk() of zero words, pages that are still zero page are skipped and stay shared
+	void zeros( int count )
+	{
+		for ( int done = 0; done < count; )
+		{
+			int n = std::min( count - done, PAGE_WORDS - (org & (PAGE_WORDS - 1)) );
+			if ( machine && !dryRun && machine->bus->isZeroPage( org ) )
+				org += n;
+			else
+				bulk( n, []( int ) { return mWord( 0 ); } );
+			done += n;
+		}
+	}
+	void incbin();
+	void table();
+	// '(' lexem joined with following ones up to closing bracket, local labels made full
+	std::string collectExpr( const std::string &lexem );
+	// false if expression uses symbol not defined yet (value is 0 then)
+	bool evalExpr( const std::string &expr, int &value, int line );
+
+	void preProcessFile( const std::string &fileName, const IncludeResolver &resolver, int depth );
+	void preProcessText( std::string_view text, int fileNum, const IncludeResolver &resolver, int depth );
+	// source text named fileName, file is read if source is nullptr
+	bool process( const std::string_view *source, const std::string &fileName, const IncludeResolver &resolver );
+
 public:
-	Assembler() = delete;
+	// assembles into own 64K word image
+	Assembler(): machine( nullptr ), image( 65536 ) {};
 	Assembler( const Assembler &src ) = delete;
+	// assembles into memory of machine
 	Assembler( Machine *m ): machine( m ) {};
 
 	void setOrg( mWord newOrg )
@@ -132,13 +224,13 @@ public:
 	{	
 		if ( addr == -1 )
 			addr = org++;
-		machine->mem[ addr ] = machine->instr.encode( _cmd, _r, _y, _x );
+		write( addr, Instruction::encode( _cmd, _r, _y, _x ) );
 	};
 	void data( mWord _data, int addr = -1 )
 	{
 		if ( addr == -1 )
 			addr = org++;
-		machine->mem[ addr ] = _data;
+		write( addr, _data );
 	};
 
 	void reset();
@@ -146,10 +238,31 @@ public:
 	void parseEnd();
 	mWord parseConstExpr( const std::string &expr, int addrForForward = -1 );
 
-	void preProcessFile( const std::string &fileName );
-
 	bool parseFile( const std::string &fileName );
+	// source from memory starting at address 0, includes are resolved by callback (files if empty)
+	bool assemble( std::string_view source, const IncludeResolver &resolver = nullptr );
+	// result of standalone assembly
+	const std::vector< mWord > &getImage() const
+	{
+		return image;
+	}
+	// peephole pass: 'r <- 0' becomes one word xor, add/addi become adds/addis and
+	// 'r <- r + k' is merged into preceding addis of r, where flags are dead before next read
+	void setOptimize( bool enable )
+	{
+		optimize = enable;
+	}
+	const PeepholeStats &getPeepholeStats() const
+	{
+		return stats;
+	}
 	std::string getErrorMessage() { return errorMessage; };
+	// labels sorted by address, local ones ('parent.local') on request
+	std::vector< Symbol > getSymbols( bool withLocals = false );
+	const std::vector< Symbol > &getHooks() const
+	{
+		return hooks;
+	}
 
 };
 
@@ -0,0 +1,93 @@
+#include "simpleton4co.h"
+
+namespace Simpleton
+{
+
+void Task::promise_type::return_void()
+{
+	executor->finished();
+}
+
+Executor::Executor( int threadCount )
+{
+	for ( int i = 0; i < threadCount; i++ )
+		threads.emplace_back( &Executor::worker, this );
+}
+
+Executor::~Executor()
+{
+	{
+		std::lock_guard< std::mutex > guard( mutex );
+		stopping = true;
+	}
+	wakeup.notify_all();
+	for ( auto &t : threads )
+		t.join();
+}
+
+void Executor::spawn( Task task )
+{
+	std::coroutine_handle< Task::promise_type > h = task.handle;
+	task.handle = nullptr;
+	h.promise().executor = this;
+	{
+		std::lock_guard< std::mutex > guard( mutex );
+		alive++;
+	}
+	schedule( h );
+}
+
+void Executor::schedule( std::coroutine_handle<> handle )
+{
+	{
+		std::lock_guard< std::mutex > guard( mutex );
+		ready.push_back( handle );
+	}
+	wakeup.notify_one();
+}
+
+void Executor::finished()
+{
+	std::lock_guard< std::mutex > guard( mutex );
+	if ( --alive == 0 )
+		done.notify_all();
+}
+
+void Executor::wait()
+{
+	std::unique_lock< std::mutex > lock( mutex );
+	done.wait( lock, [ this ]() { return alive == 0; } );
+}
+
+void Executor::worker()
+{
+	while ( true )
+	{
+		std::coroutine_handle<> h;
+		{
+			std::unique_lock< std::mutex > lock( mutex );
+			wakeup.wait( lock, [ this ]() { return stopping || !ready.empty(); } );
+			if ( ready.empty() )
+				return;	// stopping
+			h = ready.front();
+			ready.pop_front();
+		}
+		h.resume();
+	}
+}
+
+Task runAsync( Executor &executor, Machine &machine, uint64_t slice )
+{
+	while ( true )
+	{
+		Machine::StopReason reason = machine.run( slice );
+		if ( reason == Machine::StopInputWait )
+			co_await InputAwaiter{ executor, *machine.getBus() };
+		else if ( reason == Machine::StopLimit )
+			co_await executor.yield();
+		else
+			co_return;	// halt or debugger stop
+	}
+}
+
+}	// namespace Simpleton
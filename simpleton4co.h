@@ -0,0 +1,113 @@
+#ifndef SIMPLETON_4_CO_H
+#define SIMPLETON_4_CO_H
+
+#include <coroutine>
+#include <condition_variable>
+#include <thread>
+#include "simpleton4.h"
+
+namespace Simpleton
+{
+
+class Executor;
+
+// Fire-and-forget coroutine owned by Executor, frame is freed when it finishes.
+class Task
+{
+public:
+	struct promise_type
+	{
+		Executor *executor = nullptr;
+
+		Task get_return_object()
+		{
+			return Task( std::coroutine_handle< promise_type >::from_promise( *this ) );
+		}
+		std::suspend_always initial_suspend() noexcept { return {}; };	// started by Executor::spawn()
+		std::suspend_never final_suspend() noexcept { return {}; };
+		void return_void();
+		void unhandled_exception()
+		{
+			std::terminate();
+		}
+	};
+
+	Task( const Task &src ) = delete;
+	Task( Task &&src ): handle( src.handle )
+	{
+		src.handle = nullptr;
+	}
+	~Task()
+	{
+		if ( handle )
+			handle.destroy();	// never spawned
+	}
+
+private:
+	std::coroutine_handle< promise_type > handle;
+
+	explicit Task( std::coroutine_handle< promise_type > h ): handle( h ) {};
+
+	friend class Executor;
+};
+
+// Runs coroutines on a few host threads, suspended ones cost nothing until resumed.
+class Executor
+{
+private:
+	std::mutex				mutex;
+	std::condition_variable			wakeup, done;
+	std::deque< std::coroutine_handle<> >	ready;
+	std::vector< std::thread >		threads;
+	int					alive = 0;
+	bool					stopping = false;
+
+	void worker();
+	void finished();
+
+	friend struct Task::promise_type;
+
+public:
+	explicit Executor( int threadCount = 1 );
+	Executor( const Executor &src ) = delete;
+	~Executor();
+
+	void spawn( Task task );
+	void schedule( std::coroutine_handle<> handle );
+	// blocks until every spawned task has finished
+	void wait();
+
+	struct YieldAwaiter
+	{
+		Executor &executor;
+		bool await_ready() { return false; };
+		void await_suspend( std::coroutine_handle<> h ) { executor.schedule( h ); };
+		void await_resume() {};
+	};
+	// puts current task to the end of ready queue
+	YieldAwaiter yield()
+	{
+		return YieldAwaiter{ *this };
+	}
+};
+
+// Suspends until host pushes console input into machine bus.
+struct InputAwaiter
+{
+	Executor &executor;
+	Bus &bus;
+	bool await_ready() { return false; };
+	bool await_suspend( std::coroutine_handle<> h )
+	{
+		return bus.waitInput( [ &ex = executor, h ]() { ex.schedule( h ); } );
+	};
+	void await_resume() {};
+};
+
+// Machine execution as coroutine: runs slices of instructions, yields between them
+// and sleeps while guest polls empty host console. Bus must be in host console mode.
+Task runAsync( Executor &executor, Machine &machine, uint64_t slice = 10000 );
+
+}	// namespace Simpleton
+
+#endif // SIMPLETON_4_CO_H
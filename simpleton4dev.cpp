@@ -0,0 +1,550 @@
+#include "simpleton4.h"
+#include <cstring>
+#include <algorithm>
+#include <cstdio>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace Simpleton
+{
+
+void MathUnit::reset()
+{
+	xLo = xHi = y = 0;
+	resLo = resHi = rem = 0;
+	status = 0;
+}
+
+mWord MathUnit::read( mWord port )
+{
+	switch ( port )
+	{
+	case PORT_MATH_X_LO:	return xLo;
+	case PORT_MATH_X_HI:	return xHi;
+	case PORT_MATH_Y:	return y;
+	case PORT_MATH_CMD:	return status;
+	case PORT_MATH_RES_LO:	return resLo;
+	case PORT_MATH_RES_HI:	return resHi;
+	case PORT_MATH_REM:	return rem;
+	};
+	return 0;
+}
+
+void MathUnit::write( mWord port, mWord data )
+{
+	switch ( port )
+	{
+	case PORT_MATH_X_LO:	xLo = data; break;
+	case PORT_MATH_X_HI:	xHi = data; break;
+	case PORT_MATH_Y:	y = data; break;
+	case PORT_MATH_CMD:	execute( data ); break;
+	};	// results are read-only
+}
+
+void MathUnit::execute( mWord cmd )
+{
+	uint32_t res = 0;
+	status = 0;
+	rem = 0;
+	switch ( cmd )
+	{
+	case MATH_MUL:
+			res = uint32_t( xLo ) * uint32_t( y );
+			break;
+	case MATH_IMUL:
+			res = uint32_t( int32_t( int16_t( xLo ) ) * int32_t( int16_t( y ) ) );
+			break;
+	case MATH_DIV:
+			if ( y == 0 )
+			{
+				status = MATH_STATUS_DIV_ZERO;
+				res = 0xFFFFFFFF;
+				rem = xLo;
+			}
+			else
+			{
+				uint32_t dividend = (uint32_t( xHi ) << 16) | xLo;
+				res = dividend / y;
+				rem = dividend % y;
+			}
+			break;
+	case MATH_IDIV:
+			if ( y == 0 )
+			{
+				status = MATH_STATUS_DIV_ZERO;
+				res = 0xFFFFFFFF;
+				rem = xLo;
+			}
+			else
+			{
+				// 64-bit to survive INT32_MIN / -1
+				int64_t dividend = int32_t( (uint32_t( xHi ) << 16) | xLo );
+				int64_t quot = dividend / int16_t( y );
+				if ( quot > INT32_MAX )
+					status = MATH_STATUS_OVERFLOW;
+				res = uint32_t( quot );
+				rem = mWord( dividend % int16_t( y ) );
+			}
+			break;
+	default:
+			status = MATH_STATUS_BAD_CMD;
+			break;
+	};
+	resLo = res & 0xFFFF;
+	resHi = res >> 16;
+}
+
+bool MappedFile::open( const std::string &fileName, bool readOnly )
+{
+	close();
+#ifdef _WIN32
+	HANDLE file = CreateFileA( fileName.c_str(), readOnly ? GENERIC_READ : (GENERIC_READ | GENERIC_WRITE),
+				FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+	if ( file == INVALID_HANDLE_VALUE )
+		return false;
+	LARGE_INTEGER size;
+	if ( !GetFileSizeEx( file, &size ) )
+	{
+		CloseHandle( file );
+		return false;
+	}
+	if ( size.QuadPart == 0 )
+	{
+		CloseHandle( file );
+		return true;	// empty file cannot be mapped
+	}
+	HANDLE mapping = CreateFileMappingA( file, nullptr, readOnly ? PAGE_READONLY : PAGE_READWRITE, 0, 0, nullptr );
+	CloseHandle( file );
+	if ( mapping == nullptr )
+		return false;
+	view = MapViewOfFile( mapping, readOnly ? FILE_MAP_READ : FILE_MAP_WRITE, 0, 0, 0 );
+	CloseHandle( mapping );	// view keeps the mapping alive
+	if ( view == nullptr )
+		return false;
+	bytes = size_t( size.QuadPart );
+#else
+	int fd = ::open( fileName.c_str(), readOnly ? O_RDONLY : O_RDWR );
+	if ( fd < 0 )
+		return false;
+	struct stat st;
+	if ( fstat( fd, &st ) != 0 )
+	{
+		::close( fd );
+		return false;
+	}
+	if ( st.st_size == 0 )
+	{
+		::close( fd );
+		return true;	// empty file cannot be mapped
+	}
+	void *p = mmap( nullptr, size_t( st.st_size ), readOnly ? PROT_READ : (PROT_READ | PROT_WRITE), MAP_SHARED, fd, 0 );
+	::close( fd );	// mapping outlives descriptor
+	if ( p == MAP_FAILED )
+		return false;
+	view = p;
+	bytes = size_t( st.st_size );
+#endif
+	return true;
+}
+
+void MappedFile::close()
+{
+	if ( view == nullptr )
+		return;
+#ifdef _WIN32
+	UnmapViewOfFile( view );
+#else
+	munmap( view, bytes );
+#endif
+	view = nullptr;
+	bytes = 0;
+}
+
+bool StorageDevice::attach( const std::string &fileName, bool readOnly )
+{
+	detach();
+	if ( !file.open( fileName, readOnly ) )
+		return false;
+	if ( file.size() < DISK_SECTOR_WORDS * 2 )
+	{
+		file.close();
+		return false;
+	}
+	image = static_cast< mWord * >( file.data() );
+	sectors = file.size() / (DISK_SECTOR_WORDS * 2);	// trailing partial sector is ignored
+	writable = !readOnly;
+	status = 0;
+	return true;
+}
+
+void StorageDevice::detach()
+{
+	if ( image == nullptr )
+		return;
+	file.close();
+	image = nullptr;
+	sectors = 0;
+	writable = false;
+	status = DISK_STATUS_NO_MEDIA;
+}
+
+bool Framebuffer::attach( mWord at, const std::string &frameDir, const std::string &sharedFile )
+{
+	const size_t bytes = DISPLAY_PIXELS * 3;
+	if ( at + DISPLAY_PIXELS > PORT_START )
+		return false;
+	shared.close();
+	if ( !sharedFile.empty() )
+	{
+		// file of other size is replaced, viewer maps the same file
+		if ( !shared.open( sharedFile, false ) || (shared.size() != bytes) )
+		{
+			shared.close();
+			std::vector< uint8_t > black( bytes, 0 );
+			std::ofstream ofs( sharedFile, std::ios::binary );
+			ofs.write( reinterpret_cast< const char * >( black.data() ), bytes );
+			ofs.close();
+			if ( ofs.fail() || !shared.open( sharedFile, false ) || (shared.size() != bytes) )
+				return false;
+		}
+		rgb = static_cast< uint8_t * >( shared.data() );
+	}
+	else
+	{
+		own.assign( bytes, 0 );
+		rgb = own.data();
+	}
+	base = at;
+	dir = frameDir;
+	frames = 0;
+	failed = false;
+	markAll();
+	return true;
+}
+
+bool Framebuffer::frame( Bus &bus )
+{
+	uint64_t tiles = dirty.exchange( 0 );
+	if ( (base < 0) || (tiles == 0) )
+		return !failed;
+	for ( int t = 0; t < 64; t++ )
+	{
+		if ( !((tiles >> t) & 1) )
+			continue;
+		int x0 = (t % DISPLAY_TILES_X) * DISPLAY_TILE;
+		int y0 = (t / DISPLAY_TILES_X) * DISPLAY_TILE;
+		for ( int y = y0; y < y0 + DISPLAY_TILE; y++ )
+		{
+			uint8_t *p = rgb + (y * DISPLAY_WIDTH + x0) * 3;
+			for ( int x = x0; x < x0 + DISPLAY_TILE; x++ )
+			{
+				// RGB565, top bits are repeated to get full range
+				mWord w = bus.read( mWord( base + y * DISPLAY_WIDTH + x ) );
+				int r = w >> 11, g = (w >> 5) & 63, b = w & 31;
+				*p++ = (r << 3) | (r >> 2);
+				*p++ = (g << 2) | (g >> 4);
+				*p++ = (b << 3) | (b >> 2);
+			}
+		}
+	}
+	frames++;
+	if ( dir.empty() )
+		return !failed;
+	char name[ 32 ];
+	snprintf( name, sizeof( name ), "/frame%05u.ppm", frames );
+	std::ofstream ofs( dir + name, std::ios::binary );
+	ofs << "P6\n" << DISPLAY_WIDTH << " " << DISPLAY_HEIGHT << "\n255\n";
+	ofs.write( reinterpret_cast< const char * >( rgb ), DISPLAY_PIXELS * 3 );
+	if ( ofs.fail() )
+		failed = true;
+	return !failed;
+}
+
+void StorageDevice::reset()
+{
+	sector = 0;
+	addr = count = 0;
+	status = (image == nullptr) ? DISK_STATUS_NO_MEDIA : 0;
+}
+
+mWord StorageDevice::read( mWord port )
+{
+	switch ( port )
+	{
+	case PORT_DISK_SECTOR_LO:	return sector & 0xFFFF;
+	case PORT_DISK_SECTOR_HI:	return sector >> 16;
+	case PORT_DISK_ADDR:		return addr;
+	case PORT_DISK_COUNT:		return count;
+	case PORT_DISK_CMD:		return status;
+	case PORT_DISK_SIZE_LO:		return sectors & 0xFFFF;
+	case PORT_DISK_SIZE_HI:		return sectors >> 16;
+	};
+	return 0;
+}
+
+void StorageDevice::write( mWord port, mWord data, Bus &bus )
+{
+	switch ( port )
+	{
+	case PORT_DISK_SECTOR_LO:	sector = (sector & 0xFFFF0000) | data; break;
+	case PORT_DISK_SECTOR_HI:	sector = (sector & 0x0000FFFF) | (uint32_t( data ) << 16); break;
+	case PORT_DISK_ADDR:		addr = data; break;
+	case PORT_DISK_COUNT:		count = data; break;
+	case PORT_DISK_CMD:		execute( data, bus ); break;
+	};
+}
+
+void StorageDevice::execute( mWord cmd, Bus &bus )
+{
+	if ( image == nullptr )
+	{
+		status = DISK_STATUS_NO_MEDIA | DISK_STATUS_ERROR;
+		return;
+	}
+	// whole transfer must fit into image and into RAM below the I/O page
+	uint32_t words = uint32_t( count ) * DISK_SECTOR_WORDS;
+	if (	((cmd != DISK_READ) && (cmd != DISK_WRITE)) ||
+		((cmd == DISK_WRITE) && !writable) ||
+		(uint64_t( sector ) + count > sectors) ||
+		(uint32_t( addr ) + words > PORT_START) )
+	{
+		status = DISK_STATUS_ERROR;
+		return;
+	}
+	// image words are little-endian as host words are
+	mWord *data = image + size_t( sector ) * DISK_SECTOR_WORDS;
+	uint32_t cur = addr;
+	while ( words > 0 )
+	{
+		// one memcpy per page touched, pages may be mapped anywhere or shared
+		uint32_t offs = cur & (PAGE_WORDS - 1);
+		uint32_t chunk = std::min( words, uint32_t( PAGE_WORDS ) - offs );
+		if ( cmd == DISK_READ )
+			memcpy( bus.pageForWrite( cur ) + offs, data, chunk * sizeof( mWord ) );
+		else
+			memcpy( data, bus.pageForRead( cur ) + offs, chunk * sizeof( mWord ) );
+		data += chunk;
+		cur += chunk;
+		words -= chunk;
+	}
+	status = DISK_STATUS_DONE;
+}
+
+void TimerDevice::reset()
+{
+	period = 0;
+	ctrl = 0;
+	deadline = 0;
+	tag++;	// drop events still in queue
+}
+
+mWord TimerDevice::read( mWord port, uint64_t cycles )
+{
+	switch ( port )
+	{
+	case PORT_TIMER_PERIOD:	return period;
+	case PORT_TIMER_CTRL:	return ctrl;
+	case PORT_TIMER_COUNT:
+			if ( !armed() || (deadline <= cycles) )
+				return 0;
+			return mWord( (deadline - cycles) >> ((ctrl >> TIMER_PRESCALE_SHIFT) & 0xF) );
+	};
+	return 0;
+}
+
+bool TimerDevice::write( mWord port, mWord data, uint64_t cycles )
+{
+	if ( port == PORT_TIMER_PERIOD )
+		period = data;
+	else if ( port == PORT_TIMER_CTRL )
+		ctrl = data;
+	else
+		return false;
+	// any reprogramming restarts countdown
+	tag++;
+	if ( period == 0 )
+		ctrl &= ~TIMER_ENABLE;
+	if ( !armed() )
+		return false;
+	deadline = cycles + interval();
+	return true;
+}
+
+bool TimerDevice::fire( const Event &event )
+{
+	if ( (event.tag != tag) || !armed() )
+		return false;
+	if ( ctrl & TIMER_ONE_SHOT )
+		ctrl &= ~TIMER_ENABLE;
+	else
+		deadline += interval();
+	return true;
+}
+
+void PortLog::startRecord()
+{
+	mode = Record;
+	data.clear();
+	last = 0;
+	pending = false;
+}
+
+void PortLog::startReplay()
+{
+	mode = Replay;
+	pos = 0;
+	last = 0;
+	pending = false;
+	append = false;
+}
+
+bool PortLog::load( const std::string &fileName )
+{
+	std::ifstream ifs( fileName, std::ios::binary );
+	if ( ifs.fail() )
+		return false;
+	data.assign( std::istreambuf_iterator< char >( ifs ), std::istreambuf_iterator< char >() );
+	return true;
+}
+
+bool PortLog::save( const std::string &fileName )
+{
+	if ( (mode == Record) && pending )
+	{
+		flush();
+		pending = false;
+	}
+	std::ofstream ofs( fileName, std::ios::binary );
+	ofs.write( reinterpret_cast< const char * >( data.data() ), data.size() );
+	return !ofs.fail();
+}
+
+void PortLog::put( uint64_t value )
+{
+	while ( value >= 0x80 )
+	{
+		data.push_back( uint8_t( value | 0x80 ) );
+		value >>= 7;
+	}
+	data.push_back( uint8_t( value ) );
+}
+
+bool PortLog::get( uint64_t &value )
+{
+	value = 0;
+	for ( int shift = 0; (pos < data.size()) && (shift < 64); shift += 7 )
+	{
+		uint8_t b = data[ pos++ ];
+		value |= uint64_t( b & 0x7F ) << shift;
+		if ( !(b & 0x80) )
+			return true;
+	}
+	return false;
+}
+
+void PortLog::flush()
+{
+	put( cur.delta );
+	data.push_back( cur.port );
+	put( cur.value );
+	put( cur.repeat );
+}
+
+void PortLog::record( uint64_t retired, mWord port, mWord value )
+{
+	if ( mode != Record )
+		return;
+	Entry e{ retired - last, uint8_t( port - PORT_START ), value, 0 };
+	last = retired;
+	if ( pending && (e.delta == cur.delta) && (e.port == cur.port) && (e.value == cur.value) )
+	{
+		cur.repeat++;
+		return;
+	}
+	if ( pending )
+		flush();
+	cur = e;
+	pending = true;
+}
+
+// next entry of replayed log to cur
+bool PortLog::parse()
+{
+	uint64_t v;
+	entryPos = pos;
+	used = 0;
+	if ( !get( cur.delta ) || (pos >= data.size()) )
+		return false;
+	cur.port = data[ pos++ ];
+	if ( !get( v ) || !get( cur.repeat ) )
+		return false;
+	cur.value = mWord( v );
+	cur.repeat++;	// count this read too
+	pending = true;
+	return true;
+}
+
+bool PortLog::replay( uint64_t retired, mWord port, mWord &value )
+{
+	if ( (!pending || (cur.repeat == 0)) && !parse() )
+		return false;
+	if ( (last + cur.delta != retired) || (cur.port != uint8_t( port - PORT_START )) )
+		return false;
+	last = retired;
+	cur.repeat--;
+	used++;
+	value = cur.value;
+	return true;
+}
+
+PortLog::Cursor PortLog::tell()
+{
+	if ( mode == Record )
+		return Cursor{ data.size(), pending ? cur.repeat + 1 : 0, last };
+	if ( pending )
+		return Cursor{ entryPos, used, last };
+	return Cursor{ pos, 0, last };
+}
+
+void PortLog::seek( const Cursor &cursor )
+{
+	if ( (mode == Record) && pending )
+		flush();
+	mode = Replay;
+	pending = false;
+	append = true;
+	pos = cursor.pos;
+	if ( cursor.used > 0 )
+	{
+		// entry partly replayed
+		parse();
+		cur.repeat -= cursor.used;
+		used = cursor.used;
+	}
+	last = cursor.last;
+}
+
+void PortLog::trim( size_t bytes )
+{
+	data.erase( data.begin(), data.begin() + bytes );
+	pos -= std::min( pos, bytes );
+	entryPos -= std::min( entryPos, bytes );
+}
+
+bool PortLog::resume()
+{
+	if ( (mode != Replay) || !append || (pos < data.size()) || (pending && (cur.repeat > 0)) )
+		return false;
+	mode = Record;
+	pending = false;
+	return true;
+}
+
+}	// namespace Simpleton
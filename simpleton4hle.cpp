@@ -0,0 +1,90 @@
+#include "simpleton4hle.h"
+
+namespace Simpleton
+{
+
+// both loops end with testing move of zero word
+static void zeroFlags( Machine &m )
+{
+	mWord psw = m.getReg( REG_PSW ) & ~((1 << FLAG_CARRY) | (1 << FLAG_SIGN));
+	m.setReg( REG_PSW, psw | (1 << FLAG_ZERO) );
+}
+
+static void ret( Machine &m )
+{
+	mWord sp = m.getReg( REG_SP );
+	m.setReg( REG_PC, m.load( sp ) );
+	m.setReg( REG_SP, sp + 1 );
+}
+
+// words before zero terminator, -1 if it is not below I/O page
+static int length( Machine &m, mWord str )
+{
+	for ( int addr = str; addr < PORT_START; addr++ )
+	{
+		if ( m.load( addr ) == 0 )
+			return addr - str;
+	}
+	return -1;
+}
+
+// r0 - zero terminated string, written to console
+static bool strPrint( Machine &m )
+{
+	mWord str = m.getReg( REG_R0 );
+	int len = length( m, str );
+	if ( len < 0 )
+		return false;
+	for ( int i = 0; i < len; i++ )
+		m.store( PORT_CONSOLE, m.load( str + i ) );
+	m.setReg( REG_R0, str + len );
+	m.setReg( REG_R1, 0 );
+	zeroFlags( m );
+	ret( m );
+	return true;
+}
+
+// r0 - zero terminated source, r1 - destination, r2 - scratch
+static bool strCopy( Machine &m )
+{
+	mWord src = m.getReg( REG_R0 );
+	mWord dst = m.getReg( REG_R1 );
+	int len = length( m, src );
+	// destination ahead of source overwrites terminator, guest loop would not end
+	if ( (len < 0) || (dst + len >= PORT_START) || ((dst > src) && (dst <= src + len)) )
+		return false;
+	for ( int i = 0; i <= len; i++ )
+		m.store( dst + i, m.load( src + i ) );
+	m.setReg( REG_R0, src + len );
+	m.setReg( REG_R1, dst + len );
+	m.setReg( REG_R2, 0 );
+	zeroFlags( m );
+	ret( m );
+	return true;
+}
+
+Machine::Hook findHook( const std::string &name )
+{
+	if ( name == "str_print" )
+		return strPrint;
+	if ( name == "str_copy" )
+		return strCopy;
+	return nullptr;
+}
+
+int installHooks( Machine &m, const std::vector< Symbol > &symbols )
+{
+	int count = 0;
+	for ( auto &s : symbols )
+	{
+		Machine::Hook hook = findHook( s.name );
+		if ( hook )
+		{
+			m.setHook( s.addr, hook );
+			count++;
+		}
+	}
+	return count;
+}
+
+}	// namespace Simpleton
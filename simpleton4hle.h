@@ -0,0 +1,20 @@
+#ifndef SIMPLETON_4_HLE_H
+#define SIMPLETON_4_HLE_H
+
+#include "simpleton4.h"
+
+namespace Simpleton
+{
+
+// Native versions of common guest routines for Machine::setHook().
+// Each one has the exact effect of its guest code (see README) including final flags and 'ret',
+// and declines calls it cannot finish, e.g. string running into I/O page.
+
+// native routine by name, empty if unknown
+Machine::Hook findHook( const std::string &name );
+// hooks every symbol named as native routine, returns number of hooks
+int installHooks( Machine &m, const std::vector< Symbol > &symbols );
+
+}	// namespace Simpleton
+
+#endif // SIMPLETON_4_HLE_H
@@ -0,0 +1,164 @@
+#ifndef SIMPLETON_4_NATIVE_H
+#define SIMPLETON_4_NATIVE_H
+
+#include "simpleton4.h"
+
+namespace Simpleton
+{
+
+// Runtime of C++ code generated by aot.cpp from assembled images.
+// Generated routines keep registers in locals and use these helpers for everything
+// that has to behave exactly as Machine::step() does: cycles, memory, ports and events.
+struct Native
+{
+	typedef void (*Routine)( Machine &m );
+
+	struct CodeWord
+	{
+		mWord	addr;
+		int	routine;
+	};
+
+	struct Program
+	{
+		const Routine	*routines;
+		bool		*valid;		// cleared when routine code is overwritten
+		const CodeWord	*entries;	// instruction addresses routines can start at
+		int		entryCount;
+		const CodeWord	*words;		// every word routines were compiled from
+		int		wordCount;
+	};
+
+	static const CostModel &cost( Machine &m )
+	{
+		return m.cost;
+	}
+	static void enter( Machine &m, mWord *reg, mWord &a )
+	{
+		for ( int i = 0; i < 8; i++ )
+			reg[ i ] = m.reg[ i ];
+		a = m.a;
+	}
+	static void leave( Machine &m, mWord *reg, mWord pc, mWord a )
+	{
+		reg[ REG_PC ] = pc;
+		for ( int i = 0; i < 8; i++ )
+			m.reg[ i ] = reg[ i ];
+		m.a = a;
+	}
+
+	static void tick( Machine &m, int cycles )
+	{
+		m.cycles += cycles;
+	}
+	// [ pc ] operand or address, value is known when code is generated
+	static mWord immediate( Machine &m, mWord value )
+	{
+		m.cycles += m.cost.immediate;
+		m.perf.reads++;
+		return value;
+	}
+	static mWord read( Machine &m, mWord addr )
+	{
+		m.charge( addr, m.cost.read, m.perf.reads );
+		return m.getMem( addr );
+	}
+	static void write( Machine &m, mWord addr, mWord data )
+	{
+		m.charge( addr, m.cost.write, m.perf.writes );
+		m.setMem( addr, data );
+	}
+	// end of instruction, true when events are due
+	static bool retire( Machine &m )
+	{
+		m.retired++;
+		return m.cycles >= m.nextEvent;
+	}
+	static void events( Machine &m )
+	{
+		m.processEvents();
+	}
+	// routine returns to run() on stop or when compiled code was changed
+	static bool stopped( Machine &m )
+	{
+		return (m.stopReason != Machine::StopNone) || !m.nativeWrites.empty();
+	}
+
+	static void apply( mWord &psw, mWord &a, uint32_t tmp )
+	{
+		a = tmp & 0xFFFF;
+		psw &= ~((1 << FLAG_CARRY) | (1 << FLAG_ZERO) | (1 << FLAG_SIGN));
+		if ( tmp & 0x10000 )
+			psw |= 1 << FLAG_CARRY;
+		if ( a == 0 )
+			psw |= 1 << FLAG_ZERO;
+		if ( a & 0x8000 )
+			psw |= 1 << FLAG_SIGN;
+	}
+	static bool carry( mWord psw )
+	{
+		return (psw >> FLAG_CARRY) & 1;
+	}
+	static mWord cadd( mWord psw, mWord x, mWord y )
+	{
+		mWord cond = (x >> 13) & 0b111;
+		x = x & 0b1111111111111;
+		if ( x & 0b1000000000000 )
+			x = x | 0b1110000000000000;
+		bool zero = (psw >> FLAG_ZERO) & 1;
+		bool carry = (psw >> FLAG_CARRY) & 1;
+		bool sign = (psw >> FLAG_SIGN) & 1;
+		if (	((cond == COND_ZERO) && zero) ||
+			((cond == COND_NZERO) && !zero) ||
+			((cond == COND_CARRY) && carry) ||
+			((cond == COND_NCARRY) && !carry) ||
+			((cond == COND_SIGN) && sign) ||
+			((cond == COND_NSIGN) && !sign) )
+			return y + x;
+		return y;
+	}
+
+	// runs compiled routines where possible, interpreter elsewhere
+	static Machine::StopReason run( Machine &m, const Program &program )
+	{
+		std::vector< int > owner( 65536, -1 );
+		for ( int i = 0; i < program.entryCount; i++ )
+		{
+			if ( owner[ program.entries[ i ].addr ] < 0 )
+				owner[ program.entries[ i ].addr ] = program.entries[ i ].routine;
+		}
+		// self-modifying code is caught by trapped writes to compiled words
+		for ( int i = 0; i < program.wordCount; i++ )
+		{
+			Machine::setBit( m.nativeMap, program.words[ i ].addr, true );
+			m.updateTraps( program.words[ i ].addr );
+		}
+		m.nativeWrites.clear();
+		m.stopReason = Machine::StopNone;
+		while ( true )
+		{
+			if ( m.currentOp() == 0 )
+				return m.stopReason = Machine::StopHalt;
+			int k = owner[ m.reg[ REG_PC ] ];
+			if ( (k >= 0) && program.valid[ k ] )
+				program.routines[ k ]( m );
+			else
+				m.step();
+			for ( mWord addr : m.nativeWrites )
+			{
+				for ( int i = 0; i < program.wordCount; i++ )
+				{
+					if ( program.words[ i ].addr == addr )
+						program.valid[ program.words[ i ].routine ] = false;
+				}
+			}
+			m.nativeWrites.clear();
+			if ( m.stopReason != Machine::StopNone )
+				return m.stopReason;
+		}
+	}
+};
+
+}	// namespace Simpleton
+
+#endif // SIMPLETON_4_NATIVE_H